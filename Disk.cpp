@@ -2,16 +2,26 @@
 
 #include <memory>
 #include <fstream>
+#include <cerrno>
+#include <fcntl.h>
+#include <linux/fs.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// bytes one pooled buffer holds, bigger reads go through it in pieces
+const size_t DIRECT_BUFFER_SIZE = 1 << 20;
 
 
 DiskOverRegFile::DiskOverRegFile(const std::string& file_path) {
-    file_.open(file_path, std::ifstream::binary | std::ifstream::in);
+    fd_ = open(file_path.c_str(), O_RDONLY);
+    if (fd_ < 0) {
+        throw std::runtime_error("can't open " + file_path + ": " + strerror(errno));
+    }
 }
 
 DiskOverRegFile::~DiskOverRegFile(){
-    if (file_.is_open()) {
-        file_.close();
-    }
+    close(fd_);
 }
 
 void Disk::read(void* buffer, size_t size, uint64_t offset) {
@@ -20,18 +30,22 @@ void Disk::read(void* buffer, size_t size, uint64_t offset) {
     }
     
     size_t block_size = get_block_size();
-    std::unique_ptr<char> tmp_block(new char[block_size]);
+
+    // per-thread, since one disk may be shared by several parsers
+    static thread_local Arena scratch(4096);
+    Arena::Scope scope(scratch);
+    char* tmp_block = scratch.allocate(block_size);
     
     uint64_t middle_offset = (offset + block_size - 1) / block_size;
     size_t left_chunk_size = middle_offset * block_size - offset;
     if (left_chunk_size >= size){
-        read_blocks(tmp_block.get(), 1, middle_offset - 1);
-        memcpy(buffer, tmp_block.get() + block_size - left_chunk_size, size);
+        read_blocks(tmp_block, 1, middle_offset - 1);
+        memcpy(buffer, tmp_block + block_size - left_chunk_size, size);
         return;
     }
     if (left_chunk_size){
-        read_blocks(tmp_block.get(), 1, middle_offset - 1);
-        memcpy(buffer, tmp_block.get() + block_size - left_chunk_size, left_chunk_size);
+        read_blocks(tmp_block, 1, middle_offset - 1);
+        memcpy(buffer, tmp_block + block_size - left_chunk_size, left_chunk_size);
     }
     
     size_t middle_chunk_block_count = (size - left_chunk_size) / block_size;
@@ -40,8 +54,8 @@ void Disk::read(void* buffer, size_t size, uint64_t offset) {
     size_t right_chunk_size = (size - left_chunk_size) % block_size;
 
     if (right_chunk_size) {
-        read_blocks(tmp_block.get(), 1, middle_offset + middle_chunk_block_count);
-        memcpy((char*)buffer + size - right_chunk_size, tmp_block.get(), right_chunk_size);
+        read_blocks(tmp_block, 1, middle_offset + middle_chunk_block_count);
+        memcpy((char*)buffer + size - right_chunk_size, tmp_block, right_chunk_size);
     }
 }
 
@@ -50,9 +64,24 @@ void DiskOverRegFile::read_blocks(void* buffer, size_t size, uint64_t offset) {
     if (size == 0) {
         return;
     }
+    // pread, so that a parser and its read pipeline can share the file
     size_t block_size = get_block_size();
-    file_.seekg(offset * block_size, file_.beg);
-    file_.read((char*)buffer, size * block_size);
+    size_t done = 0;
+    while (done < size * block_size) {
+        ssize_t result = pread(fd_, (char*)buffer + done, size * block_size - done, offset * block_size + done);
+        if (result < 0 && errno == EINTR) {
+            continue;
+        }
+        if (result < 0) {
+            throw std::runtime_error(std::string("disk read failed: ") + strerror(errno));
+        }
+        if (result == 0) {
+            // past the end of the file
+            memset((char*)buffer + done, 0, size * block_size - done);
+            return;
+        }
+        done += result;
+    }
 }
 
 
@@ -60,4 +89,190 @@ inline size_t DiskOverRegFile::get_block_size() {
     return 512;
 }
 
+void DiskOverRegFile::prefetch(uint64_t offset, size_t size) {
+    posix_fadvise(fd_, offset, size, POSIX_FADV_WILLNEED);
+}
+
+bool DiskOverRegFile::concurrent_reads() {
+    return true;
+}
+
+
+DiskWindow::DiskWindow(std::shared_ptr<Disk> disk, uint64_t offset, uint64_t size) : disk_(disk) {
+    size_t block_size = disk_->get_block_size();
+    if (offset % block_size || size % block_size) {
+        throw std::runtime_error("disk window is not aligned to blocks");
+    }
+    first_block_ = offset / block_size;
+    block_count_ = size / block_size;
+}
+
+void DiskWindow::read_blocks(void* buffer, size_t size, uint64_t offset) {
+    if (offset + size > block_count_) {
+        throw std::runtime_error("read past the end of the disk window");
+    }
+    disk_->read_blocks(buffer, size, first_block_ + offset);
+}
+
+size_t DiskWindow::get_block_size() {
+    return disk_->get_block_size();
+}
+
+void DiskWindow::read(void* buffer, size_t size, uint64_t offset) {
+    size_t block_size = disk_->get_block_size();
+    if (offset + size > block_count_ * block_size) {
+        throw std::runtime_error("read past the end of the disk window");
+    }
+    disk_->read(buffer, size, first_block_ * block_size + offset);
+}
+
+void DiskWindow::prefetch(uint64_t offset, size_t size) {
+    uint64_t window_size = block_count_ * disk_->get_block_size();
+    if (offset < window_size) {
+        disk_->prefetch(first_block_ * disk_->get_block_size() + offset, std::min<uint64_t>(size, window_size - offset));
+    }
+}
+
+bool DiskWindow::concurrent_reads() {
+    return disk_->concurrent_reads();
+}
+
+
+DiskOverDevice::DiskOverDevice(const std::string& path, bool direct) {
+    fd_ = open(path.c_str(), O_RDONLY | (direct ? O_DIRECT : 0));
+    geometry_.direct = direct && fd_ >= 0;
+    if (fd_ < 0 && direct && errno == EINVAL) {
+        // filesystems like tmpfs refuse O_DIRECT
+        fd_ = open(path.c_str(), O_RDONLY);
+    }
+    if (fd_ < 0) {
+        throw std::runtime_error("can't open " + path + ": " + strerror(errno));
+    }
 
+    struct stat st;
+    if (fstat(fd_, &st)) {
+        close(fd_);
+        throw std::runtime_error("can't stat " + path + ": " + strerror(errno));
+    }
+    int logical = 0;
+    unsigned int physical = 0;
+    uint64_t size = 0;
+    if (S_ISBLK(st.st_mode)) {
+        ioctl(fd_, BLKSSZGET, &logical);
+        ioctl(fd_, BLKPBSZGET, &physical);
+        ioctl(fd_, BLKGETSIZE64, &size);
+    } else {
+        // a file has no sectors, its filesystem's preferred I/O size stands in for them
+        physical = st.st_blksize;
+        size = st.st_size;
+    }
+    geometry_.logical_sector = logical >= 512 ? logical : 512;
+    geometry_.physical_sector = physical >= geometry_.logical_sector && !(physical & (physical - 1)) &&
+            physical <= DIRECT_BUFFER_SIZE ? physical : geometry_.logical_sector;
+    geometry_.size = size;
+}
+
+DiskOverDevice::~DiskOverDevice() {
+    for (char* buffer : free_buffers_) {
+        free(buffer);
+    }
+    close(fd_);
+}
+
+size_t DiskOverDevice::get_block_size() {
+    return geometry_.logical_sector;
+}
+
+void DiskOverDevice::read_blocks(void* buffer, size_t size, uint64_t offset) {
+    read(buffer, size * geometry_.logical_sector, offset * geometry_.logical_sector);
+}
+
+char* DiskOverDevice::take_buffer() {
+    {
+        std::lock_guard<std::mutex> lock(pool_mutex_);
+        if (!free_buffers_.empty()) {
+            char* buffer = free_buffers_.back();
+            free_buffers_.pop_back();
+            return buffer;
+        }
+    }
+    void* buffer;
+    if (posix_memalign(&buffer, geometry_.physical_sector, DIRECT_BUFFER_SIZE)) {
+        throw std::bad_alloc();
+    }
+    return (char*) buffer;
+}
+
+void DiskOverDevice::give_buffer(char* buffer) {
+    std::lock_guard<std::mutex> lock(pool_mutex_);
+    free_buffers_.push_back(buffer);
+}
+
+// whole physical sectors into an aligned buffer
+void DiskOverDevice::read_aligned(char* buffer, size_t size, uint64_t offset) {
+    size_t done = 0;
+    // the last sector of a file may be partial, what's past its end is zeroes
+    while (done < size && offset + done < geometry_.size) {
+        ssize_t result = pread(fd_, buffer + done, size - done, offset + done);
+        if (result < 0 && errno == EINTR) {
+            continue;
+        }
+        if (result <= 0) {
+            throw std::runtime_error(std::string("disk read failed: ") +
+                    (result < 0 ? strerror(errno) : "unexpected end"));
+        }
+        done += result;
+    }
+    memset(buffer + done, 0, size - done);
+}
+
+void DiskOverDevice::read(void* buffer, size_t size, uint64_t offset) {
+    if (offset + size > geometry_.size) {
+        throw std::runtime_error("read past the end of the disk");
+    }
+    uint32_t align = geometry_.physical_sector;
+    char* out = (char*) buffer;
+
+    while (size > 0) {
+        if (offset % align == 0 && size % align == 0 && (uintptr_t) out % align == 0) {
+            read_aligned(out, size, offset);
+            return;
+        }
+        uint64_t start = offset / align * align;
+        size_t lead = offset - start;
+        size_t chunk = size < DIRECT_BUFFER_SIZE - lead ? size : DIRECT_BUFFER_SIZE - lead;
+        size_t length = (lead + chunk + align - 1) / align * align;
+
+        char* pooled = take_buffer();
+        try {
+            read_aligned(pooled, length, start);
+        } catch (...) {
+            give_buffer(pooled);
+            throw;
+        }
+        memcpy(out, pooled + lead, chunk);
+        give_buffer(pooled);
+
+        out += chunk;
+        offset += chunk;
+        size -= chunk;
+    }
+}
+
+void DiskOverDevice::prefetch(uint64_t offset, size_t size) {
+    if (!geometry_.direct) {
+        posix_fadvise(fd_, offset, size, POSIX_FADV_WILLNEED);
+    }
+}
+
+bool DiskOverDevice::concurrent_reads() {
+    return true;
+}
+
+std::shared_ptr<Disk> OpenDisk(const std::string& path) {
+    struct stat st;
+    if (stat(path.c_str(), &st) == 0 && S_ISBLK(st.st_mode)) {
+        return std::shared_ptr<Disk>(new DiskOverDevice(path));
+    }
+    return std::shared_ptr<Disk>(new DiskOverRegFile(path));
+}
@@ -1,35 +1,613 @@
 #include "FS.h"
 
+#include <cmath>
+#include <random>
+#include <sys/resource.h>
+
 void FSParser::Parse(BlockFunc& printBlock, MetadataFunc& printMetadata) {
-    if (filesystem_ != nullptr) {
-        filesystem_->Parse(printBlock, printMetadata);
-    } else {
+    Parse(printBlock, printMetadata, ScanFilter());
+}
+
+void FSParser::Parse(BlockFunc& printBlock, MetadataFunc& printMetadata, const ScanFilter& filter) {
+    run_scan([&]() {
+        filesystem_->Parse(printBlock, printMetadata, filter);
+    });
+}
+
+void FSParser::run_scan(const std::function<void()>& scan) {
+    if (filesystem_ == nullptr) {
         throw std::runtime_error("ERROR: FS was not inited");
     }
-};
+    filesystem_->paths_.reset(filesystem_->print_path_ ? new PathIndex() : nullptr);
+    {
+#ifdef FS_STAT_SCAN_STATS
+        ScanTimer timer(filesystem_->stats_.parse_ns);
+#endif
+        scan();
+    }
+    if (filesystem_->paths_) {
+        filesystem_->paths_->resolve(filesystem_->filter_, print_path_);
+        filesystem_->paths_.reset();
+    }
+    record_peak_rss();
+}
 
-FSParser::FSParser(std::shared_ptr<Disk> disk) {
+bool FSParser::Lookup(uint64_t file_num, BlockFunc& printBlock, MetadataFunc& printMetadata) {
+    if (filesystem_ == nullptr) {
+        throw std::runtime_error("ERROR: FS was not inited");
+    }
+    return filesystem_->lookup_file(file_num, printBlock, printMetadata);
+}
+
+FSType FSParser::Detect(std::shared_ptr<Disk> disk) {
     int ext_sig = 0;
     disk->read(&ext_sig, 2, 1024 + 0x38);
     if (ext_sig == 0xEF53) {
-        printf("found ext\n");
-        filesystem_ = new Ext(disk);
-        return;
+        return FS_EXT;
     }
 
     int ntfs_sig = 0;
     disk->read(&ntfs_sig, 4, 3);
     if (ntfs_sig == 0x5346544e) {
-        printf("found ntfs\n");
+        return FS_NTFS;
+    }
+
+    return FS_UNKNOWN;
+}
+
+FSParser::FSParser(std::shared_ptr<Disk> disk) : memory_budget_(0), peak_rss_(0), verify_checksums_(false) {
+    switch (Detect(disk)) {
+    case FS_EXT:
+        fprintf(stderr, "found ext\n");
+        filesystem_ = new Ext(disk);
+        break;
+    case FS_NTFS:
+        fprintf(stderr, "found ntfs\n");
         filesystem_ = new NTFS(disk);
-        return;
+        break;
+    default:
+        filesystem_ = nullptr;
     }
+}
 
+FSParser::FSParser() : memory_budget_(0), peak_rss_(0), verify_checksums_(false) {
     filesystem_ = nullptr;
 }
 
+// taken off the budget for the scratch arena and Disk::read's block buffer
+const uint64_t SCRATCH_RESERVE = 128 * 1024;
+
+void FSParser::set_memory_budget(uint64_t bytes) {
+    memory_budget_ = bytes;
+    if (filesystem_ != nullptr) {
+        filesystem_->set_memory_budget(bytes);
+    }
+    if (sched_) {
+        sched_->set_budget(bytes == 0 ? ReadScheduler::DEFAULT_BUDGET :
+                bytes > SCRATCH_RESERVE ? bytes - SCRATCH_RESERVE : 0);
+    }
+}
+
+void FSParser::set_path_output(const PathFunc& printPath) {
+    print_path_ = printPath;
+    if (filesystem_ != nullptr) {
+        filesystem_->set_path_output(printPath);
+    }
+}
+
+void FSParser::set_verify_checksums(bool verify) {
+    verify_checksums_ = verify;
+    if (filesystem_ != nullptr) {
+        filesystem_->set_verify_checksums(verify);
+    }
+}
+
+void FSParser::set_read_depth(int depth) {
+    if (filesystem_ != nullptr) {
+        filesystem_->set_read_depth(depth);
+    }
+    if (sched_) {
+        sched_->reset();
+        pipeline_.reset(depth > 0 && disk_->concurrent_reads() ? new ReadPipeline(disk_, stats_, depth) : nullptr);
+        sched_->set_pipeline(pipeline_.get());
+    }
+}
+
+ChecksumReport FSParser::checksums() const {
+    return filesystem_ != nullptr ? filesystem_->checksum_report_ : checksum_report_;
+}
+
+MemoryReport FSParser::memory() const {
+    MemoryReport report;
+    report.budget = memory_budget_;
+    report.peak_buffers = filesystem_ != nullptr ? filesystem_->buffer_bytes() : 0;
+    report.peak_rss = peak_rss_;
+    return report;
+}
+
+void FSParser::record_peak_rss() {
+    struct rusage usage;
+    if (getrusage(RUSAGE_SELF, &usage) == 0) {
+        peak_rss_ = (uint64_t) usage.ru_maxrss * 1024;
+    }
+}
+
 FSParser::~FSParser() {
     if (filesystem_ != nullptr) {
         delete filesystem_;
     }
 }
+
+void FSParser::read(ScanStats::ReadSite site, void* buffer, size_t size, uint64_t offset) {
+    (void) site; // counted only in a stats build
+    if (sched_ && sched_->lookup(buffer, size, offset)) {
+        SCAN_STAT_ADD(scheduled_hits, 1);
+        return;
+    }
+    SCAN_STAT_ADD(reads[site], 1);
+    SCAN_STAT_ADD(read_bytes[site], size);
+    SCAN_STAT_TIMER(read_ns[site]);
+    disk_->read(buffer, size, offset);
+}
+
+void FSParser::issue_reads() {
+    std::vector<ReadScheduler::Request>& requests = sched_->schedule();
+    if (pipeline_) {
+#ifdef FS_STAT_SCAN_STATS
+        for (const ReadScheduler::Request& request : requests) {
+            SCAN_STAT_ADD(reads[request.site], 1);
+            SCAN_STAT_ADD(read_bytes[request.site], request.size);
+        }
+#endif
+        pipeline_->submit(requests);
+    } else {
+        for (ReadScheduler::Request& request : requests) {
+            read(request.site, request.data, request.size, request.offset);
+        }
+    }
+    sched_->commit();
+}
+
+bool ReadScheduler::add(ScanStats::ReadSite site, uint64_t offset, size_t size) {
+    if (find(offset, size)) {
+        return true;
+    }
+    if (used_ + size > budget_) {
+        return false;
+    }
+    used_ += size;
+    pending_.push_back({offset, size, site, nullptr, 0});
+    return true;
+}
+
+std::vector<ReadScheduler::Request>& ReadScheduler::schedule() {
+    std::sort(pending_.begin(), pending_.end(), [](const Request& a, const Request& b) {
+        return a.offset < b.offset;
+    });
+
+    // overlapping and adjacent reads become one
+    size_t merged = 0;
+    for (size_t i = 0; i < pending_.size(); i++) {
+        if (merged && pending_[merged - 1].offset + pending_[merged - 1].size >= pending_[i].offset) {
+            Request& last = pending_[merged - 1];
+            last.size = std::max(last.offset + last.size, pending_[i].offset + pending_[i].size) - last.offset;
+        } else {
+            pending_[merged++] = pending_[i];
+        }
+    }
+    pending_.resize(merged);
+
+    if (!buffer_ && !pending_.empty()) {
+        buffer_.reset(new char[budget_]);
+    }
+    // merged reads are never larger than the ones added, so they fit
+    for (Request& request : pending_) {
+        request.data = buffer_.get() + buffer_used_;
+        buffer_used_ += request.size;
+    }
+    return pending_;
+}
+
+void ReadScheduler::commit() {
+    issued_.insert(issued_.end(), pending_.begin(), pending_.end());
+    std::sort(issued_.begin(), issued_.end(), [](const Request& a, const Request& b) {
+        return a.offset < b.offset;
+    });
+    pending_.clear();
+}
+
+const ReadScheduler::Request* ReadScheduler::find(uint64_t offset, size_t size) const {
+    // the last read starting at or before offset, earlier ones may still cover it after a merge
+    auto it = std::upper_bound(issued_.begin(), issued_.end(), offset, [](uint64_t offset, const Request& request) {
+        return offset < request.offset;
+    });
+    while (it != issued_.begin()) {
+        --it;
+        if (it->offset + it->size >= offset + size) {
+            return &*it;
+        }
+        if (it->offset + budget_ < offset) {
+            break;
+        }
+    }
+    return nullptr;
+}
+
+bool ReadScheduler::lookup(void* buffer, size_t size, uint64_t offset) const {
+    const Request* request = find(offset, size);
+    if (request == nullptr) {
+        return false;
+    }
+    if (pipeline_) {
+        pipeline_->wait(*request);
+    }
+    memcpy(buffer, request->data + (offset - request->offset), size);
+    return true;
+}
+
+void ReadScheduler::reset() {
+    if (pipeline_) {
+        pipeline_->drain();
+    }
+    pending_.clear();
+    issued_.clear();
+    buffer_used_ = 0;
+    used_ = 0;
+}
+
+void ReadScheduler::set_budget(size_t budget) {
+    reset();
+    buffer_.reset();
+    budget_ = budget;
+}
+
+ReadPipeline::ReadPipeline(std::shared_ptr<Disk> disk, ScanStats& stats, int depth) : disk_(disk), stats_(stats),
+        depth_(depth), first_ticket_(1), next_ticket_(1), in_flight_(0), stopping_(false) {}
+
+ReadPipeline::~ReadPipeline() {
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        stopping_ = true;
+        // what hasn't started isn't needed anymore, the parser is gone
+        in_flight_ -= queue_.size();
+        queue_.clear();
+    }
+    queued_.notify_all();
+    for (std::thread& thread : threads_) {
+        thread.join();
+    }
+}
+
+void ReadPipeline::submit(std::vector<ReadScheduler::Request>& requests) {
+    if (requests.empty()) {
+        return;
+    }
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        while (threads_.size() < (size_t) depth_) {
+            threads_.emplace_back(&ReadPipeline::work, this);
+        }
+        for (ReadScheduler::Request& request : requests) {
+            request.ticket = next_ticket_++;
+            queue_.push_back(request);
+            done_.push_back(0);
+        }
+        in_flight_ += requests.size();
+    }
+    queued_.notify_all();
+}
+
+void ReadPipeline::wait(const ReadScheduler::Request& request) {
+    std::unique_lock<std::mutex> lock(mutex_);
+    if (request.ticket < first_ticket_) {
+        return;
+    }
+    finished_.wait(lock, [&] {
+        return done_[request.ticket - first_ticket_];
+    });
+    rethrow();
+}
+
+void ReadPipeline::drain() {
+    std::unique_lock<std::mutex> lock(mutex_);
+    finished_.wait(lock, [this] {
+        return in_flight_ == 0;
+    });
+    done_.clear();
+    first_ticket_ = next_ticket_;
+    rethrow();
+}
+
+// the first failure is reported once, to whoever waits next
+void ReadPipeline::rethrow() {
+    if (error_) {
+        std::exception_ptr error;
+        std::swap(error, error_);
+        std::rethrow_exception(error);
+    }
+}
+
+void ReadPipeline::work() {
+    std::unique_lock<std::mutex> lock(mutex_);
+    while (true) {
+        queued_.wait(lock, [this] {
+            return stopping_ || !queue_.empty();
+        });
+        if (queue_.empty()) {
+            return;
+        }
+        ReadScheduler::Request request = queue_.front();
+        queue_.pop_front();
+        lock.unlock();
+
+        std::exception_ptr error;
+        try {
+            SCAN_STAT_TIMER(read_ns[request.site]);
+            disk_->read(request.data, request.size, request.offset);
+        } catch (...) {
+            error = std::current_exception();
+        }
+
+        lock.lock();
+        if (error && !error_) {
+            error_ = error;
+        }
+        done_[request.ticket - first_ticket_] = 1;
+        in_flight_--;
+        finished_.notify_all();
+    }
+}
+
+namespace {
+
+const size_t NOT_FOUND = SIZE_MAX;
+const size_t RESOLVING = SIZE_MAX - 1; // on the chain being resolved, also NOT_FOUND in memo_
+
+}
+
+void PathIndex::add(uint64_t file_num, uint64_t parent_num, const char* name, size_t name_len) {
+    entries_.push_back({file_num, parent_num, names_.size(), name_len});
+    names_.append(name, name_len);
+}
+
+size_t PathIndex::find(uint64_t file_num) const {
+    auto it = std::lower_bound(entries_.begin(), entries_.end(), file_num, [](const Entry& entry, uint64_t file_num) {
+        return entry.file_num < file_num;
+    });
+    return it != entries_.end() && it->file_num == file_num ? it - entries_.begin() : NOT_FOUND;
+}
+
+void PathIndex::resolve(const ScanFilter& filter, const PathFunc& printPath) {
+    std::stable_sort(entries_.begin(), entries_.end(), [](const Entry& a, const Entry& b) {
+        return a.file_num < b.file_num;
+    });
+    entries_.erase(std::unique(entries_.begin(), entries_.end(), [](const Entry& a, const Entry& b) {
+        return a.file_num == b.file_num;
+    }), entries_.end());
+    memo_.assign(entries_.size(), NOT_FOUND);
+
+    std::string path_buffer;
+    for (size_t i = 0; i < entries_.size(); i++) {
+        if (filter.accepts_file(entries_[i].file_num)) {
+            path(i, path_buffer);
+            printPath(entries_[i].file_num, path_buffer);
+        }
+    }
+
+    entries_.clear();
+    names_.clear();
+    memo_.clear();
+    dir_paths_.clear();
+}
+
+void PathIndex::path(size_t entry, std::string& result) {
+    // up to the root, a resolved directory or a missing parent, then back down memoizing the directories
+    chain_.clear();
+    for (size_t current = entry;;) {
+        if (memo_[current] < RESOLVING) {
+            result = dir_paths_[memo_[current]];
+            break;
+        }
+        const Entry& link = entries_[current];
+        if (link.parent_num == link.file_num) {
+            memo_[current] = dir_paths_.size();
+            dir_paths_.push_back("");
+            result.clear();
+            break;
+        }
+        memo_[current] = RESOLVING;
+        chain_.push_back(current);
+        size_t parent = find(link.parent_num);
+        if (parent == NOT_FOUND || memo_[parent] == RESOLVING) {
+            result = "<" + std::to_string(link.parent_num) + ">";
+            break;
+        }
+        current = parent;
+    }
+
+    for (size_t i = chain_.size(); i-- > 0;) {
+        const Entry& link = entries_[chain_[i]];
+        result += '/';
+        result.append(names_, link.name_offset, link.name_len);
+        if (i > 0) {
+            memo_[chain_[i]] = dir_paths_.size();
+            dir_paths_.push_back(result);
+        } else {
+            memo_[chain_[i]] = NOT_FOUND;
+        }
+    }
+    if (result.empty()) {
+        result = "/";
+    }
+}
+
+const ScanStats& FSParser::stats() const {
+    return filesystem_ != nullptr ? filesystem_->stats_ : stats_;
+}
+
+bool FSParser::stats_enabled() {
+#ifdef FS_STAT_SCAN_STATS
+    return true;
+#else
+    return false;
+#endif
+}
+
+void ScanStats::reset() {
+    for (int site = 0; site < READ_SITE_COUNT; site++) {
+        reads[site] = read_bytes[site] = read_ns[site] = 0;
+    }
+    for (int depth = 0; depth < MAX_DEPTH; depth++) {
+        tree_depth[depth] = 0;
+    }
+    scheduled_hits = 0;
+    inodes_visited = records_visited = attr_list_resolutions = 0;
+    callback_ns = fixup_ns = parse_ns = 0;
+}
+
+const char* ScanStats::site_name(ReadSite site) {
+    static const char* names[READ_SITE_COUNT] = {
+        "superblock", "group_desc", "inode_bitmap", "inode", "extent_node", "indirect_block", "dir_block",
+        "boot_sector", "mft_record", "mft_bitmap", "attr_list"
+    };
+    return names[site];
+}
+
+uint64_t ScanStats::decode_ns() const {
+    uint64_t other_ns = callback_ns + fixup_ns;
+    for (int site = 0; site < READ_SITE_COUNT; site++) {
+        other_ns += read_ns[site];
+    }
+    return parse_ns > other_ns ? parse_ns - other_ns : 0;
+}
+
+namespace {
+
+const double Z_95 = 1.96;
+const int SIZE_BUCKETS = 64;
+
+struct UnitTally {
+    UnitTally() : files(0), extents(0), bytes(0), size_buckets(SIZE_BUCKETS, 0) {}
+
+    double files;
+    double extents;
+    double bytes;
+    std::vector<double> size_buckets;
+};
+
+int size_bucket(uint64_t size) {
+    int bucket = 0;
+    while (size >>= 1) {
+        bucket++;
+    }
+    return bucket;
+}
+
+// population total of x, estimated from a simple random sample of n out of N units
+Estimate total_estimate(const std::vector<double>& x, double N) {
+    double n = x.size(), mean = 0, s2 = 0;
+    for (double v : x) {
+        mean += v / n;
+    }
+    for (double v : x) {
+        s2 += n > 1 ? (v - mean) * (v - mean) / (n - 1) : 0;
+    }
+    double half = Z_95 * N * std::sqrt((1 - n / N) * s2 / n);
+    return Estimate{N * mean, N * mean - half, N * mean + half};
+}
+
+// sum(y) / sum(x) over the population, estimated from a cluster sample of n out of N units
+Estimate ratio_estimate(const std::vector<double>& y, const std::vector<double>& x, double N) {
+    double n = x.size(), sum_x = 0, sum_y = 0, s2 = 0;
+    for (size_t i = 0; i < x.size(); i++) {
+        sum_x += x[i];
+        sum_y += y[i];
+    }
+    if (sum_x == 0) {
+        return Estimate{0, 0, 0};
+    }
+    double ratio = sum_y / sum_x;
+    for (size_t i = 0; i < x.size(); i++) {
+        s2 += n > 1 ? (y[i] - ratio * x[i]) * (y[i] - ratio * x[i]) / (n - 1) : 0;
+    }
+    double mean_x = sum_x / n;
+    double half = Z_95 * std::sqrt((1 - n / N) * s2 / n) / mean_x;
+    return Estimate{ratio, ratio - half, ratio + half};
+}
+
+}
+
+SampleReport FSParser::Sample(const SampleOptions& options) {
+    if (filesystem_ == nullptr) {
+        throw std::runtime_error("ERROR: FS was not inited");
+    }
+
+    SampleReport report = SampleReport();
+    uint64_t units = filesystem_->unit_count();
+    if (units == 0) {
+        // an empty volume, every estimate is 0
+        return report;
+    }
+    uint64_t samples = std::ceil(options.fraction * units);
+    if (options.byte_budget) {
+        samples = options.byte_budget / filesystem_->unit_bytes();
+    }
+    // two units are the least for a variance estimate
+    samples = std::min(units, std::max<uint64_t>(samples, 2));
+
+    report.units_total = units;
+    report.units_sampled = samples;
+    report.files_sampled = 0;
+
+    // stratified sampling: one random unit out of each of the equal-sized strata
+    std::mt19937_64 random(options.seed);
+    std::vector<UnitTally> tallies(samples);
+    uint64_t first_unit, end_unit; // all of them, with no filter
+    filesystem_->begin_scan(ScanFilter(), first_unit, end_unit);
+    for (uint64_t stratum = 0; stratum < samples; stratum++) {
+        uint64_t first = stratum * units / samples;
+        uint64_t last = (stratum + 1) * units / samples;
+        uint64_t unit = first + random() % (last - first);
+
+        UnitTally& tally = tallies[stratum];
+        std::string last_file_id;
+        BlockFunc countBlock = [&tally, &last_file_id](std::string file_id, uint64_t file_size,
+                uint64_t, uint64_t, uint64_t) {
+            if (file_id != last_file_id) {
+                tally.files++;
+                tally.bytes += file_size;
+                tally.size_buckets[size_bucket(file_size)]++;
+                last_file_id = file_id;
+            }
+            tally.extents++;
+        };
+        MetadataFunc skipMetadata = [](uint32_t, uint64_t, bool, bool, int64_t, int64_t, int64_t) {};
+        filesystem_->parse_units(countBlock, skipMetadata, unit, unit + 1);
+        report.files_sampled += tally.files;
+    }
+
+    std::vector<double> files, extents, bytes;
+    for (const UnitTally& tally : tallies) {
+        files.push_back(tally.files);
+        extents.push_back(tally.extents);
+        bytes.push_back(tally.bytes);
+    }
+    report.file_count = total_estimate(files, units);
+    report.extents_per_file = ratio_estimate(extents, files, units);
+    report.file_size = ratio_estimate(bytes, files, units);
+
+    int used_buckets = 0;
+    for (int bucket = 0; bucket < SIZE_BUCKETS; bucket++) {
+        std::vector<double> in_bucket;
+        for (const UnitTally& tally : tallies) {
+            in_bucket.push_back(tally.size_buckets[bucket]);
+            if (tally.size_buckets[bucket]) {
+                used_buckets = bucket + 1;
+            }
+        }
+        report.size_distribution.push_back(ratio_estimate(in_bucket, files, units));
+    }
+    report.size_distribution.resize(used_buckets);
+
+    return report;
+}
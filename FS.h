@@ -7,18 +7,254 @@
 #include <cstring>
 #include <memory>
 #include <fstream>
+#include <vector>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <exception>
+#include <thread>
 
+#ifdef FS_STAT_SCAN_STATS
+// adds the lifetime of the object to a ScanStats timer
+class ScanTimer {
+public:
+    ScanTimer(std::atomic<uint64_t>& counter) : counter_(counter), start_(std::chrono::steady_clock::now()) {}
+    ~ScanTimer() {
+        counter_.fetch_add(std::chrono::duration_cast<std::chrono::nanoseconds>(
+                std::chrono::steady_clock::now() - start_).count(), std::memory_order_relaxed);
+    }
+
+private:
+    std::atomic<uint64_t>& counter_;
+    std::chrono::steady_clock::time_point start_;
+};
+
+#define SCAN_STAT_ADD(counter, value) stats_.counter.fetch_add(value, std::memory_order_relaxed)
+#define SCAN_STAT_TIMER(counter) ScanTimer scan_timer_(stats_.counter)
+#else
+#define SCAN_STAT_ADD(counter, value)
+#define SCAN_STAT_TIMER(counter)
+#endif
+
+// crc32c (Castagnoli) without the final inversion, as ext4 keeps it
+uint32_t crc32c(uint32_t crc, const void* data, size_t size);
+// crc32c of count equally long buffers, crcs holds the initial values
+void crc32c_multi(uint32_t* crcs, const void* const* data, size_t size, int count);
+// crc16 (ANSI, reflected) of ext4 gdt_csum group descriptors
+uint16_t crc16(uint16_t crc, const void* data, size_t size);
+
+// Bump-pointer scratch memory for parsers. Memory is handed back by Scope
+// in LIFO order and blocks are kept, so steady-state parsing doesn't malloc.
+class Arena {
+public:
+    class Scope {
+    public:
+        Scope(Arena& arena) : arena_(arena), block_(arena.block_), offset_(arena.offset_) {}
+        ~Scope() {
+            arena_.block_ = block_;
+            arena_.offset_ = offset_;
+        }
+
+    private:
+        Arena& arena_;
+        size_t block_;
+        size_t offset_;
+    };
+
+    Arena(size_t block_size = 64 * 1024) : block_size_(block_size), block_(0), offset_(0) {}
+
+    char* allocate(size_t size) {
+        offset_ = (offset_ + 15) & ~(size_t) 15;
+        while (block_ == blocks_.size() || offset_ + size > sizes_[block_]) {
+            if (block_ < blocks_.size() && offset_ != 0) {
+                block_++;
+                offset_ = 0;
+                continue;
+            }
+            if (block_ == blocks_.size() || sizes_[block_] < size) {
+                size_t new_size = size > block_size_ ? size : block_size_;
+                blocks_.insert(blocks_.begin() + block_, std::unique_ptr<char[]>(new char[new_size]));
+                sizes_.insert(sizes_.begin() + block_, new_size);
+            }
+        }
+        char* result = blocks_[block_].get() + offset_;
+        offset_ += size;
+        return result;
+    }
+
+    void reset() {
+        block_ = offset_ = 0;
+    }
+
+    size_t capacity() const {
+        size_t total = 0;
+        for (size_t size : sizes_) {
+            total += size;
+        }
+        return total;
+    }
+
+private:
+    size_t block_size_;
+    std::vector<std::unique_ptr<char[]>> blocks_;
+    std::vector<size_t> sizes_;
+    size_t block_;
+    size_t offset_;
+};
+
+class ReadPipeline;
+
+// Gathers the metadata reads of a window of inodes or records and issues them
+// in ascending disk order, merging adjacent ones. The parser then walks the
+// window in logical order and FSParser::read finds the data here.
+class ReadScheduler {
+public:
+    struct Request {
+        uint64_t offset;
+        size_t size;
+        ScanStats::ReadSite site;
+        char* data;
+        uint64_t ticket; // of the pipeline reading it, 0 if read in place
+    };
+
+    static const size_t DEFAULT_BUDGET = 4 << 20;
+
+    ReadScheduler(size_t budget = DEFAULT_BUDGET) : budget_(budget), used_(0), buffer_used_(0),
+            pipeline_(nullptr) {}
+
+    // false if the read doesn't fit in the budget and has to be done on demand
+    bool add(ScanStats::ReadSite site, uint64_t offset, size_t size);
+    // pending reads sorted and merged, with buffers to read into
+    std::vector<Request>& schedule();
+    // makes the scheduled reads visible to lookup
+    void commit();
+    // waits for the data if it is still being read by the pipeline
+    bool lookup(void* buffer, size_t size, uint64_t offset) const;
+    // after every read still in flight is done
+    void reset();
+    void set_pipeline(ReadPipeline* pipeline) {
+        pipeline_ = pipeline;
+    }
+    // only between windows, drops the buffer
+    void set_budget(size_t budget);
+    size_t budget() const {
+        return budget_;
+    }
+    size_t capacity() const {
+        return buffer_ ? budget_ : 0;
+    }
+
+private:
+    const Request* find(uint64_t offset, size_t size) const;
 
+    size_t budget_;
+    size_t used_;
+    std::vector<Request> pending_;
+    std::vector<Request> issued_; // sorted by offset
+    std::unique_ptr<char[]> buffer_; // budget_ bytes, allocated on first use
+    size_t buffer_used_;
+    ReadPipeline* pipeline_;
+};
+
+// Reads a scheduled round in the background, in disk order and several at a time,
+// so that the device queue stays full while the parser decodes what has already
+// arrived. Each lookup waits only for the request holding its data.
+class ReadPipeline {
+public:
+    static const int DEFAULT_DEPTH = 2;
+
+    // depth threads, started with the first round
+    ReadPipeline(std::shared_ptr<Disk> disk, ScanStats& stats, int depth);
+    ~ReadPipeline();
+
+    // tickets the requests, their buffers have to stay until drain
+    void submit(std::vector<ReadScheduler::Request>& requests);
+    // rethrows the error of a failed read
+    void wait(const ReadScheduler::Request& request);
+    void drain();
+
+private:
+    void work();
+    void rethrow();
+
+    std::shared_ptr<Disk> disk_;
+    ScanStats& stats_;
+    int depth_;
+    std::vector<std::thread> threads_;
+    std::mutex mutex_;
+    std::condition_variable queued_;
+    std::condition_variable finished_;
+    std::deque<ReadScheduler::Request> queue_;
+    std::vector<char> done_; // by ticket from first_ticket_
+    uint64_t first_ticket_;
+    uint64_t next_ticket_;
+    size_t in_flight_; // queued or being read
+    std::exception_ptr error_;
+    bool stopping_;
+};
+
+// file -> (parent, name) links gathered during a scan, resolved into full
+// paths at its end. A directory that is its own parent is the root.
+class PathIndex {
+public:
+    // the first name of a file is kept, later ones (hard links) are dropped
+    void add(uint64_t file_num, uint64_t parent_num, const char* name, size_t name_len);
+    void resolve(const ScanFilter& filter, const PathFunc& printPath);
+
+private:
+    struct Entry {
+        uint64_t file_num;
+        uint64_t parent_num;
+        size_t name_offset;
+        size_t name_len;
+    };
+
+    size_t find(uint64_t file_num) const;
+    void path(size_t entry, std::string& result);
+
+    std::vector<Entry> entries_; // sorted by file_num in resolve
+    std::string names_;
+    std::vector<size_t> memo_; // index into dir_paths_ for resolved directories
+    std::vector<std::string> dir_paths_;
+    std::vector<size_t> chain_;
+};
 
 class NTFS : public FSParser {
 public:
     NTFS(std::shared_ptr<Disk> disk);
     ~NTFS();
-    void Parse(BlockFunc& printBlock, MetadataFunc& printMetadata);
+    void Parse(BlockFunc& printBlock, MetadataFunc& printMetadata, const ScanFilter& filter);
     
+protected:
+    uint64_t unit_count();
+    uint64_t unit_bytes();
+    void begin_scan(const ScanFilter& filter, uint64_t& first, uint64_t& end);
+    void parse_units(BlockFunc& printBlock, MetadataFunc& printMetadata, uint64_t first, uint64_t end);
+    uint64_t buffer_bytes();
+    bool lookup_file(uint64_t file_num, BlockFunc& printBlock, MetadataFunc& printMetadata);
+
 private:
     friend class FSParser;
+
+    struct MftRun {
+        uint64_t vcn;
+        uint64_t lcn;
+        uint64_t length;
+    };
     
+    int window_capacity();
+    uint64_t scan_bitmap_size();
+    void analize_bitmap_chunk(BlockFunc& printBlock, MetadataFunc& printMetadata,
+                              uint64_t offset, size_t count);
+    void analize_window(BlockFunc& printBlock, MetadataFunc& printMetadata,
+                        const uint64_t* window, int count);
+    void schedule_record(uint64_t fr_num);
+    void prefetch_records(uint64_t first_fr, uint64_t count);
+    void schedule_al_records(NTFSAttribute* al_attr);
+    NTFSMftEntry* window_record(uint64_t fr_num);
+    void read_record(uint64_t fr_num, char* buffer);
+    void read_records(const uint64_t* fr_nums, int count, char* records, char* valid);
+    size_t read_al_entry(NTFSAttribute* attr, size_t offset, NTFSAttrListEntry* list_entry);
     size_t read_attr(char* attr, uint64_t offset, size_t count, char* str);
     size_t read_runlist(uint64_t offset, size_t count, char* str, NTFSRunlistEntry* run_format);
     size_t read_al(NTFSMftEntry *fr, NTFSAttribute* attr, uint64_t fr_num, uint32_t type,
@@ -31,8 +267,10 @@ private:
     uint64_t read_fr_for_attr_size(uint64_t base_fr_num, uint32_t type, char* name);
     uint64_t read_al_for_attr_size(NTFSAttribute *attr, NTFSMftEntry *fr, uint64_t base_fr_num,
                     uint32_t type, char* name); 
-    size_t analize_fr(BlockFunc& printBlock, MetadataFunc& printMetadata, uint64_t fr_num);
-    void fixup(char * start);
+    size_t analize_fr(BlockFunc& printBlock, MetadataFunc& printMetadata, uint64_t fr_num, NTFSMftEntry* fr);
+    void analize_ext_records(BlockFunc& printBlock, MetadataFunc& printMetadata,
+                             NTFSAttribute* al_attr, uint64_t fr_num);
+    size_t fixup_records(char* records, size_t count, char* valid);
       
     uint32_t sector_size_;
     uint32_t sectors_per_cluster_;
@@ -44,35 +282,111 @@ private:
     size_t fr_size_;
     NTFSMftEntry *mft_fr_;
     NTFSMftEntry *tmp_fr_;
+    Arena scratch_;
+    ScanStats::ReadSite read_site_; // for reads going through read_runlist
+    std::vector<MftRun> mft_runs_;
+    // records of the window being analized, in ascending order
+    const uint64_t* window_nums_;
+    char* window_records_;
+    const char* window_valid_;
+    int window_count_; // 0 outside of a window
 };
 
 class Ext : public FSParser {
 public:
     Ext(std::shared_ptr<Disk> disk);
     ~Ext();
-    void Parse(BlockFunc& printBlock, MetadataFunc& printMetadata);
+    void Parse(BlockFunc& printBlock, MetadataFunc& printMetadata, const ScanFilter& filter);
+
+protected:
+    uint64_t unit_count();
+    uint64_t unit_bytes();
+    void begin_scan(const ScanFilter& filter, uint64_t& first, uint64_t& end);
+    void parse_units(BlockFunc& printBlock, MetadataFunc& printMetadata, uint64_t first, uint64_t end);
+    uint64_t buffer_bytes();
+    bool lookup_file(uint64_t file_num, BlockFunc& printBlock, MetadataFunc& printMetadata);
 
 private:
     friend class FSParser;
 
-    void analize_desc(BlockFunc& printBlock, MetadataFunc& printMetadata, const ExtGroupDesc& desc, uint32_t group_num);
+    // extent tree node (depth -1) or indirect block waiting for its read
+    struct MetaNode {
+        uint64_t block;
+        uint64_t first_offset;
+        uint64_t file_blocks;
+        int depth;
+        int window_index; // of the inode owning it
+        uint32_t csum_seed; // of the owning inode, for extent blocks
+    };
+
+    // the group descriptor table, one array per field
+    struct GroupTable {
+        std::vector<uint64_t> inode_bitmap; // in bytes
+        std::vector<uint64_t> inode_table;  // in bytes
+        std::vector<uint32_t> used_inodes;  // the rest of the table has never been used
+        std::vector<uint16_t> flags;
+        std::vector<char> csum_valid;
+    };
+
+    // a row widened to whole clusters, held back while the next rows may share its last cluster
+    struct ClusterRun {
+        uint32_t inode_num;
+        uint64_t file_size;
+        uint64_t offset;
+        uint64_t phys_offset;
+        uint64_t len; // 0 if none is held
+    };
+
+    // blocks of a directory to read names from
+    struct DirRun {
+        uint32_t dir_inode;
+        uint64_t block;
+        uint64_t count;
+    };
+
+    int window_capacity();
+    uint64_t desc_offset(uint64_t group_num);
+    void load_groups();
+    void parse_desc(const ExtGroupDesc& desc, uint64_t group_num);
+    bool group_in_use(uint64_t group_num);
+    bool group_has_super(uint64_t group_num);
+    void analize_groups(BlockFunc& printBlock, MetadataFunc& printMetadata, uint64_t first_group, uint64_t count);
+    void prefetch_group(uint64_t group_num);
+    int analize_window(BlockFunc& printBlock, MetadataFunc& printMetadata, const uint32_t* inode_nums,
+            const uint64_t* inode_offsets, int count, bool print_metadata);
+    void schedule_inode(const ExtInode* inode, uint32_t inode_num, int window_index);
+    void schedule_children(MetaNode node, char* valid);
+    void schedule_node(const MetaNode& node);
+    void check_superblock();
+    uint32_t inode_csum_seed(uint32_t inode_num, uint32_t generation);
+    bool desc_csum_valid(const ExtGroupDesc& desc, uint32_t group_num);
+    void verify_inodes(char* inodes, const uint32_t* inode_nums, int count, char* valid);
+    bool verify_extent_block(const char* block, uint32_t csum_seed);
     void analize_inode(BlockFunc& printBlock, MetadataFunc& printMetadata, const ExtInode* inode, uint32_t inode_num);
+    void analize_dirs();
+    void analize_dir_entries(uint32_t dir_inode, const char* entries, size_t size);
     void print_inode_metadata(MetadataFunc& printMetadata, const ExtInode* inode, uint32_t inode_num);
-    void analize_block(BlockFunc& printBlock, uint32_t& curr_offset, uint32_t block_phys_offset,
-            uint32_t& start_offset, uint32_t& start_phys_offset, uint32_t& next_phys_offset,
+    void print_extent(BlockFunc& printBlock, uint32_t inode_num, uint64_t file_size,
+            uint64_t start_offset, uint64_t start_phys_offset, uint64_t len);
+    void flush_cluster_run(BlockFunc& printBlock);
+    void analize_block(BlockFunc& printBlock, uint64_t& curr_offset, uint32_t block_phys_offset,
+            uint64_t& start_offset, uint64_t& start_phys_offset, uint64_t& next_phys_offset,
             uint64_t file_size, int depth, uint32_t inode_num);
-    void analize_extent_node(BlockFunc& printBlock, uint32_t& curr_offset, char* entry,
-            uint32_t& start_offset, uint32_t& start_phys_offset, uint32_t& next_phys_offset,
+    void analize_pointers(BlockFunc& printBlock, uint64_t& curr_offset, const uint32_t* pointers,
+            uint64_t& start_offset, uint64_t& start_phys_offset, uint64_t& next_phys_offset,
+            uint64_t file_size, uint32_t inode_num);
+    void analize_extent_node(BlockFunc& printBlock, uint64_t& curr_offset, char* entry,
+            uint64_t& start_offset, uint64_t& start_phys_offset, uint64_t& next_phys_offset,
             uint64_t file_size, int depth, uint32_t inode_num);
-    void analize_extent(BlockFunc& printBlock, uint32_t& curr_offset, const ExtExtent* extent,
-        uint32_t& start_offset, uint32_t& start_phys_offset, uint32_t& next_phys_offset,
+    void analize_extent(BlockFunc& printBlock, uint64_t& curr_offset, const ExtExtent* extent,
+        uint64_t& start_offset, uint64_t& start_phys_offset, uint64_t& next_phys_offset,
         uint64_t file_size, uint32_t inode_num);
     
     uint32_t inodes_count_;
     uint64_t blocks_count_;
     uint32_t first_block_;
     uint32_t block_size_;
-    uint32_t cluster_size_;
+    uint32_t cluster_size_; // in blocks, more than 1 only with bigalloc
     uint32_t blocks_per_group_;
     uint32_t frags_per_group_;
     uint32_t inodes_per_group_;
@@ -83,10 +397,20 @@ private:
     uint32_t feature_incompat_;
     uint32_t feature_ro_compat_;
     uint16_t desc_size_;
-    uint32_t first_meta_bg_;
+    uint32_t first_meta_bg_; // a group number
     uint64_t groups_per_flex_;
+    uint32_t backup_bgs_[2]; // with sparse_super2
+    uint8_t uuid_[16];
+    uint32_t csum_seed_;
+    bool sb_csum_valid_;
 
     uint64_t kbytes_written_;
+    Arena scratch_;
+    GroupTable groups_; // loaded by the first scan or lookup
+    std::vector<MetaNode> nodes_; // levels of the window's extent trees and block maps
+    uint32_t dir_inode_; // directory whose extents go to dir_runs_, 0 if none
+    std::vector<DirRun> dir_runs_;
+    ClusterRun cluster_run_;
 };
 
 
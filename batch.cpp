@@ -0,0 +1,194 @@
+#include "FS.h"
+#include "counting_disk.h"
+
+#include <chrono>
+#include <condition_variable>
+#include <map>
+#include <mutex>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <thread>
+
+namespace {
+
+struct DeviceQueue {
+    DeviceQueue() : running(0), started(0) {}
+
+    std::vector<size_t> jobs; // next job at the back
+    unsigned running;
+    uint64_t started;
+    std::shared_ptr<Throttle> throttle; // null if not limited
+};
+
+const size_t NO_JOB = SIZE_MAX;
+
+std::string DeviceOf(const std::string& image_path) {
+    struct stat st;
+    return stat(image_path.c_str(), &st) ? image_path : std::to_string(st.st_dev);
+}
+
+}
+
+BatchScanner::BatchScanner(const BatchOptions& options) : options_(options), memory_budget_(0) {
+    if (options_.per_device == 0) {
+        options_.per_device = 1;
+    }
+}
+
+void BatchScanner::add(const std::string& image_path, const std::string& device) {
+    jobs_.push_back({image_path, image_path, nullptr, device.empty() ? DeviceOf(image_path) : device, "", 0, 0});
+}
+
+void BatchScanner::add(const std::string& name, std::shared_ptr<Disk> disk, const std::string& device) {
+    jobs_.push_back({name, "", disk, device, "", 0, 0});
+}
+
+size_t BatchScanner::add_partitions(const std::string& image_path, const std::string& device) {
+    std::vector<Partition> partitions = FindPartitions(OpenDisk(image_path));
+    if (partitions.empty()) {
+        add(image_path, device);
+        return 1;
+    }
+
+    // each scan opens the image on its own, the partitions are read in place
+    size_t added = 0;
+    for (const Partition& partition : partitions) {
+        if (partition.filesystem == FS_UNKNOWN) {
+            continue;
+        }
+        std::string tag = "p" + std::to_string(partition.number);
+        jobs_.push_back({image_path + ":" + tag, image_path, nullptr, device.empty() ? DeviceOf(image_path) : device,
+                         tag + "/", partition.offset, partition.size});
+        added++;
+    }
+    return added;
+}
+
+const std::string& BatchScanner::tag(size_t image) const {
+    return jobs_.at(image).tag;
+}
+
+BatchReport BatchScanner::Run(const std::function<ScanSinks(size_t)>& sinks) {
+    auto start = std::chrono::steady_clock::now();
+    BatchReport report;
+    report.images.resize(jobs_.size());
+
+    std::map<std::string, DeviceQueue> devices;
+    for (size_t i = jobs_.size(); i-- > 0;) {
+        devices[jobs_[i].device].jobs.push_back(i);
+    }
+    if (options_.throttle.limited()) {
+        for (auto& device : devices) {
+            device.second.throttle.reset(new Throttle(options_.throttle));
+        }
+    }
+    std::mutex mutex;
+    std::condition_variable device_freed;
+
+    // the device with the fewest scans running, then the one served least so far
+    auto next_job = [&]() -> size_t {
+        std::unique_lock<std::mutex> lock(mutex);
+        while (true) {
+            DeviceQueue* best = nullptr;
+            bool queued = false;
+            for (auto& device : devices) {
+                DeviceQueue& queue = device.second;
+                queued |= !queue.jobs.empty();
+                if (queue.jobs.empty() || queue.running >= options_.per_device) {
+                    continue;
+                }
+                if (best == nullptr || queue.running < best->running ||
+                        (queue.running == best->running && queue.started < best->started)) {
+                    best = &queue;
+                }
+            }
+            if (!queued) {
+                return NO_JOB;
+            }
+            if (best != nullptr) {
+                size_t job = best->jobs.back();
+                best->jobs.pop_back();
+                best->running++;
+                best->started++;
+                return job;
+            }
+            device_freed.wait(lock);
+        }
+    };
+
+    auto worker = [&]() {
+        for (size_t job = next_job(); job != NO_JOB; job = next_job()) {
+            // no device is added while the workers run, so it can be looked up without the lock
+            scan(jobs_[job], sinks(job), devices.find(jobs_[job].device)->second.throttle, report.images[job]);
+            std::lock_guard<std::mutex> lock(mutex);
+            devices[jobs_[job].device].running--;
+            device_freed.notify_all();
+        }
+    };
+
+    size_t thread_count = options_.threads ? options_.threads : std::thread::hardware_concurrency();
+    thread_count = std::max<size_t>(1, std::min(thread_count, jobs_.size()));
+    memory_budget_ = options_.memory_budget / thread_count;
+    std::vector<std::thread> threads;
+    for (size_t i = 0; i < thread_count; i++) {
+        threads.push_back(std::thread(worker));
+    }
+    for (std::thread& thread : threads) {
+        thread.join();
+    }
+
+    report.files = report.extents = report.bytes_read = 0;
+    for (const BatchResult& result : report.images) {
+        report.files += result.files;
+        report.extents += result.extents;
+        report.bytes_read += result.bytes_read;
+    }
+    report.seconds = SecondsSince(start);
+    struct rusage usage;
+    report.peak_rss = getrusage(RUSAGE_SELF, &usage) ? 0 : (uint64_t) usage.ru_maxrss * 1024;
+    return report;
+}
+
+void BatchScanner::scan(const Job& job, const ScanSinks& sinks, const std::shared_ptr<Throttle>& throttle,
+        BatchResult& result) {
+    auto start = std::chrono::steady_clock::now();
+    result.name = job.name;
+    result.files = result.extents = result.bytes_read = 0;
+
+    IdlePriorityScope priority(throttle && throttle->options().idle_priority);
+    std::shared_ptr<CountingDisk> disk;
+    try {
+        std::shared_ptr<Disk> image = job.disk ? job.disk : OpenDisk(job.path);
+        if (job.size) {
+            image.reset(new DiskWindow(image, job.offset, job.size));
+        }
+        if (throttle) {
+            image.reset(new ThrottledDisk(image, throttle));
+        }
+        disk.reset(new CountingDisk(image));
+        FSParser file_sys(disk);
+        file_sys.set_memory_budget(memory_budget_);
+
+        std::string last_file_id;
+        BlockFunc countBlock = [&job, &result, &last_file_id, &sinks](std::string file_id, uint64_t file_size,
+                uint64_t offset, uint64_t phys_offset, uint64_t len) {
+            result.extents++;
+            if (file_id != last_file_id) {
+                result.files++;
+                last_file_id = file_id;
+            }
+            if (sinks.block) {
+                sinks.block(job.tag + file_id, file_size, offset, phys_offset, len);
+            }
+        };
+        MetadataFunc metadata = sinks.metadata ? sinks.metadata :
+                [](uint32_t, uint64_t, bool, bool, int64_t, int64_t, int64_t) {};
+
+        file_sys.Parse(countBlock, metadata);
+    } catch (const std::exception& e) {
+        result.error = e.what();
+    }
+
+    result.bytes_read = disk ? disk->bytes_read() : 0;
+    result.seconds = SecondsSince(start);
+}
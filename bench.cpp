@@ -0,0 +1,226 @@
+#include "fs_stat.h"
+#include "counting_disk.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fcntl.h>
+#include <iostream>
+#include <unistd.h>
+#include <vector>
+
+struct BenchOptions {
+    BenchOptions() : memory_budget(0), verify(false), direct(false), read_depth(-1) {}
+
+    uint64_t memory_budget;
+    bool verify;
+    bool direct;
+    int read_depth; // -1 for the parser's default
+    ThrottleOptions throttle;
+};
+
+struct PhaseResult {
+    double seconds;
+    uint64_t files;
+    uint64_t bytes;
+};
+
+struct RunResult {
+    PhaseResult probe;
+    PhaseResult parse;
+    MemoryReport memory;
+    ChecksumReport checksums;
+    ThrottleReport throttle;
+};
+
+// evicts the image from the page cache, no root needed unlike drop_caches
+void DropCache(const std::string& image_path) {
+    int fd = open(image_path.c_str(), O_RDONLY);
+    if (fd < 0 || posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED)) {
+        throw std::runtime_error("can't drop cache of " + image_path);
+    }
+    close(fd);
+}
+
+void PrintStats(const ScanStats& stats) {
+    for (int site = 0; site < ScanStats::READ_SITE_COUNT; site++) {
+        if (stats.reads[site]) {
+            printf("    %-16s %10llu reads %12llu bytes %10.4f s\n", ScanStats::site_name((ScanStats::ReadSite) site),
+                   (unsigned long long) stats.reads[site], (unsigned long long) stats.read_bytes[site],
+                   stats.read_ns[site] / 1e9);
+        }
+    }
+    printf("    scheduled hits %llu, inodes %llu, records %llu, attr lists %llu, tree depths",
+           (unsigned long long) stats.scheduled_hits, (unsigned long long) stats.inodes_visited,
+           (unsigned long long) stats.records_visited, (unsigned long long) stats.attr_list_resolutions);
+    for (int depth = 0; depth < ScanStats::MAX_DEPTH; depth++) {
+        printf(" %llu", (unsigned long long) stats.tree_depth[depth]);
+    }
+    printf("\n    parse %.4f s: callbacks %.4f s, fixup %.4f s, decode %.4f s\n", stats.parse_ns / 1e9,
+           stats.callback_ns / 1e9, stats.fixup_ns / 1e9, stats.decode_ns() / 1e9);
+}
+
+RunResult Run(const std::string& image_path, bool cold, const BenchOptions& options, bool print_stats = false) {
+    if (cold) {
+        DropCache(image_path);
+    }
+    RunResult result;
+    IdlePriorityScope priority(options.throttle.idle_priority);
+
+    std::shared_ptr<Disk> image(options.direct ? (Disk*) new DiskOverDevice(image_path) :
+            (Disk*) new DiskOverRegFile(image_path));
+    std::shared_ptr<Throttle> throttle(new Throttle(options.throttle));
+    if (options.throttle.limited()) {
+        image.reset(new ThrottledDisk(image, throttle));
+    }
+    std::shared_ptr<CountingDisk> disk(new CountingDisk(image));
+    auto start = std::chrono::steady_clock::now();
+    FSParser file_sys(disk);
+    file_sys.set_memory_budget(options.memory_budget);
+    file_sys.set_verify_checksums(options.verify);
+    if (options.read_depth >= 0) {
+        file_sys.set_read_depth(options.read_depth);
+    }
+    result.probe.seconds = SecondsSince(start);
+    result.probe.files = 0;
+    result.probe.bytes = disk->bytes_read();
+
+    uint64_t files = 0;
+    std::string last_file_id;
+    BlockFunc countBlock = [&files, &last_file_id](std::string file_id, uint64_t, uint64_t, uint64_t, uint64_t) {
+        if (file_id != last_file_id) {
+            files++;
+            last_file_id = file_id;
+        }
+    };
+    MetadataFunc skipMetadata = [](uint32_t, uint64_t, bool, bool, int64_t, int64_t, int64_t) {};
+
+    start = std::chrono::steady_clock::now();
+    file_sys.Parse(countBlock, skipMetadata);
+    result.parse.seconds = SecondsSince(start);
+    result.parse.files = files;
+    result.parse.bytes = disk->bytes_read() - result.probe.bytes;
+    result.memory = file_sys.memory();
+    result.checksums = file_sys.checksums();
+    result.throttle = throttle->report();
+    if (print_stats) {
+        PrintStats(file_sys.stats());
+    }
+    return result;
+}
+
+PhaseResult Median(std::vector<PhaseResult> results) {
+    std::sort(results.begin(), results.end(), [](const PhaseResult& a, const PhaseResult& b) {
+        return a.seconds < b.seconds;
+    });
+    return results[results.size() / 2];
+}
+
+void Report(const std::string& image_path, const char* cache, const char* phase, const PhaseResult& result) {
+    double seconds = std::max(result.seconds, 1e-9);
+    printf("%-32s %-5s %-5s %10.4f %10llu %12.0f %10.2f %10.2f\n", image_path.c_str(), cache, phase,
+           result.seconds, (unsigned long long) result.files, result.files / seconds,
+           result.bytes / 1e6, result.bytes / 1e6 / seconds);
+}
+
+// all images at once on a BatchScanner pool, warm cache
+void RunBatch(const std::vector<std::string>& images, unsigned threads, const BenchOptions& options) {
+    BatchOptions batch_options;
+    batch_options.threads = threads;
+    batch_options.memory_budget = options.memory_budget;
+    batch_options.throttle = options.throttle;
+    BatchScanner scanner(batch_options);
+    for (const std::string& image_path : images) {
+        scanner.add(image_path);
+    }
+    BatchReport report = scanner.Run([](size_t) { return ScanSinks(); });
+
+    for (const BatchResult& result : report.images) {
+        if (!result.error.empty()) {
+            std::cerr << result.name << ": " << result.error << std::endl;
+        }
+    }
+    PhaseResult result = {report.seconds, report.files, report.bytes_read};
+    Report("batch of " + std::to_string(images.size()) + ", " + std::to_string(threads) + " threads",
+           "warm", "parse", result);
+    printf("    peak rss %.1f MB\n", report.peak_rss / 1e6);
+}
+
+int main(int argc, char** argv) {
+    int iterations = 5;
+    unsigned threads = 0;
+    BenchOptions options;
+    std::vector<std::string> images;
+    for (int i = 1; i < argc; i++) {
+        if (!strcmp(argv[i], "-n") && i + 1 < argc) {
+            iterations = atoi(argv[++i]);
+        } else if (!strcmp(argv[i], "-j") && i + 1 < argc) {
+            threads = atoi(argv[++i]);
+        } else if (!strcmp(argv[i], "-m") && i + 1 < argc) {
+            options.memory_budget = atoll(argv[++i]) << 20;
+        } else if (!strcmp(argv[i], "-v")) {
+            options.verify = true;
+        } else if (!strcmp(argv[i], "-d")) {
+            options.direct = true;
+        } else if (!strcmp(argv[i], "-r") && i + 1 < argc) {
+            options.throttle.bytes_per_second = atof(argv[++i]) * 1e6;
+        } else if (!strcmp(argv[i], "-l") && i + 1 < argc) {
+            options.throttle.latency_target_us = atoll(argv[++i]);
+        } else if (!strcmp(argv[i], "-q") && i + 1 < argc) {
+            options.read_depth = atoi(argv[++i]);
+        } else if (!strcmp(argv[i], "-i")) {
+            options.throttle.idle_priority = true;
+        } else {
+            images.push_back(argv[i]);
+        }
+    }
+    if (images.empty() || iterations < 1) {
+        std::cerr << "usage: " << argv[0] << " [-n iterations] [-j batch_threads] [-m budget_MB] [-v] [-d]" <<
+                " [-r rate_MB/s] [-l latency_us] [-i] [-q read_depth] image..." << std::endl;
+        return 1;
+    }
+
+    printf("%-32s %-5s %-5s %10s %10s %12s %10s %10s\n", "image", "cache", "phase",
+           "seconds", "files", "files/s", "meta_MB", "meta_MB/s");
+    for (const std::string& image_path : images) {
+        MemoryReport memory;
+        ChecksumReport checksums;
+        ThrottleReport throttle;
+        for (bool cold : {true, false}) {
+            std::vector<PhaseResult> probes, parses;
+            if (!cold) {
+                Run(image_path, false, options); // warm the cache up
+            }
+            for (int iter = 0; iter < iterations; ++iter) {
+                RunResult result = Run(image_path, cold, options);
+                probes.push_back(result.probe);
+                parses.push_back(result.parse);
+                memory = result.memory;
+                checksums = result.checksums;
+                throttle = result.throttle;
+            }
+            Report(image_path, cold ? "cold" : "warm", "probe", Median(probes));
+            Report(image_path, cold ? "cold" : "warm", "parse", Median(parses));
+        }
+        printf("    parser buffers %.2f MB, peak rss %.1f MB\n", memory.peak_buffers / 1e6, memory.peak_rss / 1e6);
+        if (options.verify) {
+            printf("    checksums %llu checked, %llu failed\n", (unsigned long long) checksums.checked,
+                   (unsigned long long) checksums.failed);
+        }
+        if (options.throttle.limited()) {
+            printf("    throttle: %llu reads, %.4f s reading, %.4f s held back, %llu slow, rate %.2f MB/s\n",
+                   (unsigned long long) throttle.reads, throttle.read_ns / 1e9, throttle.wait_ns / 1e9,
+                   (unsigned long long) throttle.slow_reads, throttle.byte_rate / 1e6);
+        }
+        if (FSParser::stats_enabled()) {
+            Run(image_path, false, options, true);
+        }
+    }
+    if (threads) {
+        RunBatch(images, threads, options);
+    }
+
+    return 0;
+}
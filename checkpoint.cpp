@@ -0,0 +1,154 @@
+#include "FS.h"
+
+#include <cerrno>
+#include <cstdio>
+#include <fcntl.h>
+#include <unistd.h>
+
+namespace {
+
+const char* CHECKPOINT_MAGIC = "fs_stat checkpoint 2";
+
+struct Checkpoint {
+    uint64_t units;
+    uint64_t unit_bytes;
+    uint64_t next_unit;
+    ScanFilter filter; // a resume has to scan the same part of the image
+    std::vector<uint64_t> offsets;
+};
+
+bool same_filter(const ScanFilter& a, const ScanFilter& b) {
+    return a.first_file == b.first_file && a.last_file == b.last_file && a.min_file_size == b.min_file_size &&
+            a.attr_types == b.attr_types && a.first_phys_block == b.first_phys_block &&
+            a.last_phys_block == b.last_phys_block;
+}
+
+// so that the rename is on disk too
+bool sync_parent_dir(const std::string& path) {
+    size_t slash = path.rfind('/');
+    std::string dir = slash == std::string::npos ? "." : slash == 0 ? "/" : path.substr(0, slash);
+    int fd = open(dir.c_str(), O_RDONLY | O_DIRECTORY);
+    if (fd < 0) {
+        return false;
+    }
+    // some filesystems can't sync a directory, nothing more to do there
+    bool synced = fsync(fd) == 0 || errno == EINVAL;
+    close(fd);
+    return synced;
+}
+
+bool load_checkpoint(const std::string& path, Checkpoint& checkpoint) {
+    std::ifstream file(path);
+    if (!file.is_open()) {
+        return false;
+    }
+
+    std::string magic;
+    size_t attr_count, offset_count;
+    std::getline(file, magic);
+    file >> checkpoint.units >> checkpoint.unit_bytes >> checkpoint.next_unit;
+    ScanFilter& filter = checkpoint.filter;
+    file >> filter.first_file >> filter.last_file >> filter.min_file_size >> filter.first_phys_block >>
+            filter.last_phys_block >> attr_count;
+    filter.attr_types.resize(file ? attr_count : 0);
+    for (uint32_t& type : filter.attr_types) {
+        file >> type;
+    }
+    file >> offset_count;
+    checkpoint.offsets.resize(file ? offset_count : 0);
+    for (uint64_t& offset : checkpoint.offsets) {
+        file >> offset;
+    }
+    if (magic != CHECKPOINT_MAGIC || !file) {
+        throw std::runtime_error("can't read checkpoint " + path);
+    }
+    return true;
+}
+
+// written next to the old one and renamed over it, so a crash leaves one of them whole
+void save_checkpoint(const std::string& path, const Checkpoint& checkpoint) {
+    std::string tmp_path = path + ".tmp";
+    FILE* file = fopen(tmp_path.c_str(), "w");
+    if (file == nullptr) {
+        throw std::runtime_error("can't write checkpoint " + tmp_path);
+    }
+
+    fprintf(file, "%s\n%llu %llu %llu\n", CHECKPOINT_MAGIC, (unsigned long long) checkpoint.units,
+            (unsigned long long) checkpoint.unit_bytes, (unsigned long long) checkpoint.next_unit);
+    const ScanFilter& filter = checkpoint.filter;
+    fprintf(file, "%llu %llu %llu %llu %llu %zu", (unsigned long long) filter.first_file,
+            (unsigned long long) filter.last_file, (unsigned long long) filter.min_file_size,
+            (unsigned long long) filter.first_phys_block, (unsigned long long) filter.last_phys_block,
+            filter.attr_types.size());
+    for (uint32_t type : filter.attr_types) {
+        fprintf(file, " %u", type);
+    }
+    fprintf(file, "\n%zu", checkpoint.offsets.size());
+    for (uint64_t offset : checkpoint.offsets) {
+        fprintf(file, " %llu", (unsigned long long) offset);
+    }
+    fprintf(file, "\n");
+
+    bool written = !ferror(file) && fflush(file) == 0 && fsync(fileno(file)) == 0;
+    if (fclose(file) != 0 || !written || rename(tmp_path.c_str(), path.c_str()) != 0 ||
+            !sync_parent_dir(path)) {
+        throw std::runtime_error("can't write checkpoint " + path);
+    }
+}
+
+}
+
+void FSParser::Parse(BlockFunc& printBlock, MetadataFunc& printMetadata, const ScanFilter& filter,
+                     const CheckpointOptions& options) {
+    if (options.path.empty()) {
+        throw std::runtime_error("ERROR: no checkpoint path");
+    }
+    run_scan([&]() {
+        Checkpoint checkpoint;
+        checkpoint.units = filesystem_->unit_count();
+        checkpoint.unit_bytes = filesystem_->unit_bytes();
+        checkpoint.next_unit = 0;
+        checkpoint.filter = filter;
+
+        Checkpoint saved;
+        if (load_checkpoint(options.path, saved)) {
+            if (saved.units != checkpoint.units || saved.unit_bytes != checkpoint.unit_bytes ||
+                    saved.next_unit > saved.units) {
+                throw std::runtime_error("checkpoint " + options.path + " doesn't match the image");
+            }
+            if (!same_filter(saved.filter, filter)) {
+                throw std::runtime_error("checkpoint " + options.path + " was saved by a scan with another filter");
+            }
+            if (options.rewind_outputs) {
+                options.rewind_outputs(saved.offsets);
+            }
+            checkpoint.next_unit = saved.next_unit;
+        }
+
+        uint64_t first, end;
+        filesystem_->begin_scan(filter, first, end);
+        checkpoint.next_unit = std::max(checkpoint.next_unit, first);
+        if (filesystem_->paths_ && checkpoint.next_unit > first) {
+            // names from the units done before the checkpoint, their files were already emitted
+            BlockFunc skipBlock = [](std::string, uint64_t, uint64_t, uint64_t, uint64_t) {};
+            MetadataFunc skipMetadata = [](uint32_t, uint64_t, bool, bool, int64_t, int64_t, int64_t) {};
+            ChecksumReport checksums = filesystem_->checksum_report_;
+            filesystem_->parse_units(skipBlock, skipMetadata, first, checkpoint.next_unit);
+            filesystem_->checksum_report_ = checksums;
+        }
+
+        // up to the next multiple of the interval at a time, batched like a whole Parse
+        uint64_t interval = options.interval_units ? options.interval_units : 1;
+        while (checkpoint.next_unit < end) {
+            uint64_t stop = std::min(end, (checkpoint.next_unit / interval + 1) * interval);
+            filesystem_->parse_units(printBlock, printMetadata, checkpoint.next_unit, stop);
+            checkpoint.next_unit = stop;
+
+            if (checkpoint.next_unit < end) {
+                checkpoint.offsets = options.sync_outputs ? options.sync_outputs() : std::vector<uint64_t>();
+                save_checkpoint(options.path, checkpoint);
+            }
+        }
+        remove(options.path.c_str());
+    });
+}
@@ -0,0 +1,145 @@
+#include "FS.h"
+
+#if defined(__x86_64__) && defined(__GNUC__)
+#include <nmmintrin.h>
+#define FS_STAT_HW_CRC32C
+#endif
+
+namespace {
+
+// slicing-by-8 tables of the reflected Castagnoli polynomial
+struct Crc32cTables {
+    Crc32cTables() {
+        for (uint32_t i = 0; i < 256; i++) {
+            uint32_t crc = i;
+            for (int bit = 0; bit < 8; bit++) {
+                crc = crc & 1 ? (crc >> 1) ^ 0x82f63b78 : crc >> 1;
+            }
+            table[0][i] = crc;
+        }
+        for (uint32_t i = 0; i < 256; i++) {
+            for (int slice = 1; slice < 8; slice++) {
+                table[slice][i] = (table[slice - 1][i] >> 8) ^ table[0][table[slice - 1][i] & 0xff];
+            }
+        }
+    }
+
+    uint32_t table[8][256];
+};
+
+const Crc32cTables crc32c_tables;
+
+uint32_t crc32c_sw(uint32_t crc, const uint8_t* data, size_t size) {
+    const uint32_t (*table)[256] = crc32c_tables.table;
+    for (; size >= 8; data += 8, size -= 8) {
+        uint32_t low, high;
+        memcpy(&low, data, 4);
+        memcpy(&high, data + 4, 4);
+        low ^= crc;
+        crc = table[7][low & 0xff] ^ table[6][(low >> 8) & 0xff] ^
+                table[5][(low >> 16) & 0xff] ^ table[4][low >> 24] ^
+                table[3][high & 0xff] ^ table[2][(high >> 8) & 0xff] ^
+                table[1][(high >> 16) & 0xff] ^ table[0][high >> 24];
+    }
+    for (; size > 0; data++, size--) {
+        crc = (crc >> 8) ^ table[0][(crc ^ *data) & 0xff];
+    }
+    return crc;
+}
+
+#ifdef FS_STAT_HW_CRC32C
+__attribute__((target("sse4.2")))
+uint32_t crc32c_hw(uint32_t crc, const uint8_t* data, size_t size) {
+    uint64_t crc64 = crc;
+    for (; size >= 8; data += 8, size -= 8) {
+        uint64_t word;
+        memcpy(&word, data, 8);
+        crc64 = _mm_crc32_u64(crc64, word);
+    }
+    crc = crc64;
+    for (; size > 0; data++, size--) {
+        crc = _mm_crc32_u8(crc, *data);
+    }
+    return crc;
+}
+
+// four chains at once so that the instruction's latency is hidden
+__attribute__((target("sse4.2")))
+void crc32c_x4_hw(uint32_t* crcs, const void* const* data, size_t size) {
+    const uint8_t* bytes[4];
+    uint64_t crc64[4];
+    for (int lane = 0; lane < 4; lane++) {
+        bytes[lane] = (const uint8_t*) data[lane];
+        crc64[lane] = crcs[lane];
+    }
+    size_t offset = 0;
+    for (; offset + 8 <= size; offset += 8) {
+        uint64_t words[4];
+        for (int lane = 0; lane < 4; lane++) {
+            memcpy(&words[lane], bytes[lane] + offset, 8);
+        }
+        crc64[0] = _mm_crc32_u64(crc64[0], words[0]);
+        crc64[1] = _mm_crc32_u64(crc64[1], words[1]);
+        crc64[2] = _mm_crc32_u64(crc64[2], words[2]);
+        crc64[3] = _mm_crc32_u64(crc64[3], words[3]);
+    }
+    for (int lane = 0; lane < 4; lane++) {
+        crcs[lane] = crc32c_hw(crc64[lane], bytes[lane] + offset, size - offset);
+    }
+}
+
+bool detect_hw_crc32c() {
+    __builtin_cpu_init();
+    return __builtin_cpu_supports("sse4.2");
+}
+
+// the crc32 instruction where the CPU has it, checked once
+const bool hw_crc32c = detect_hw_crc32c();
+#endif
+
+struct Crc16Table {
+    Crc16Table() {
+        for (uint32_t i = 0; i < 256; i++) {
+            uint16_t crc = i;
+            for (int bit = 0; bit < 8; bit++) {
+                crc = crc & 1 ? (crc >> 1) ^ 0xa001 : crc >> 1;
+            }
+            table[i] = crc;
+        }
+    }
+
+    uint16_t table[256];
+};
+
+const Crc16Table crc16_table;
+
+}
+
+uint32_t crc32c(uint32_t crc, const void* data, size_t size) {
+#ifdef FS_STAT_HW_CRC32C
+    if (hw_crc32c) {
+        return crc32c_hw(crc, (const uint8_t*) data, size);
+    }
+#endif
+    return crc32c_sw(crc, (const uint8_t*) data, size);
+}
+
+void crc32c_multi(uint32_t* crcs, const void* const* data, size_t size, int count) {
+    int i = 0;
+#ifdef FS_STAT_HW_CRC32C
+    for (; hw_crc32c && i + 4 <= count; i += 4) {
+        crc32c_x4_hw(crcs + i, data + i, size);
+    }
+#endif
+    for (; i < count; i++) {
+        crcs[i] = crc32c(crcs[i], data[i], size);
+    }
+}
+
+uint16_t crc16(uint16_t crc, const void* data, size_t size) {
+    const uint8_t* bytes = (const uint8_t*) data;
+    for (size_t i = 0; i < size; i++) {
+        crc = (crc >> 8) ^ crc16_table.table[(crc ^ bytes[i]) & 0xff];
+    }
+    return crc;
+}
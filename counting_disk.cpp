@@ -0,0 +1,37 @@
+#include "counting_disk.h"
+
+CountingDisk::CountingDisk(std::shared_ptr<Disk> disk) : disk_(disk), bytes_read_(0) {}
+
+void CountingDisk::read_blocks(void* buffer, size_t size, uint64_t offset) {
+    bytes_read_ += size * get_block_size();
+    disk_->read_blocks(buffer, size, offset);
+}
+
+void CountingDisk::read(void* buffer, size_t size, uint64_t offset) {
+    uint64_t block_size = get_block_size();
+    if (size) {
+        bytes_read_ += ((offset + size + block_size - 1) / block_size - offset / block_size) * block_size;
+    }
+    disk_->read(buffer, size, offset);
+}
+
+void CountingDisk::prefetch(uint64_t offset, size_t size) {
+    disk_->prefetch(offset, size);
+}
+
+size_t CountingDisk::get_block_size() {
+    return disk_->get_block_size();
+}
+
+bool CountingDisk::concurrent_reads() {
+    return disk_->concurrent_reads();
+}
+
+uint64_t CountingDisk::bytes_read() {
+    return bytes_read_;
+}
+
+double SecondsSince(std::chrono::steady_clock::time_point start) {
+    return std::chrono::duration_cast<std::chrono::microseconds>
+            (std::chrono::steady_clock::now() - start).count() / 1000000.0;
+}
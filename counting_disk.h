@@ -0,0 +1,30 @@
+#ifndef COUNTING_DISK_H
+#define	COUNTING_DISK_H
+
+#include "fs_stat.h"
+
+#include <atomic>
+#include <chrono>
+#include <memory>
+
+// counts metadata bytes a scan pulls from its image
+class CountingDisk : public Disk {
+public:
+    CountingDisk(std::shared_ptr<Disk> disk);
+
+    void read_blocks(void* buffer, size_t size, uint64_t offset);
+    // whole to the disk, counted by the blocks it touches as if split
+    void read(void* buffer, size_t size, uint64_t offset);
+    void prefetch(uint64_t offset, size_t size);
+    size_t get_block_size();
+    bool concurrent_reads();
+    uint64_t bytes_read();
+
+private:
+    std::shared_ptr<Disk> disk_;
+    std::atomic<uint64_t> bytes_read_; // from the parser and its read pipeline
+};
+
+double SecondsSince(std::chrono::steady_clock::time_point start);
+
+#endif	/* COUNTING_DISK_H */
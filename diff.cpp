@@ -0,0 +1,409 @@
+#include "FS.h"
+
+#include <cstdio>
+#include <cstdlib>
+#include <queue>
+#include <unistd.h>
+
+namespace {
+
+const char MAP_MAGIC[8] = {'f', 's', 'x', 'm', 'a', 'p', '0', '1'};
+
+struct MapExtent {
+    std::string file_id;
+    uint64_t file_size;
+    uint64_t offset;
+    uint64_t phys_offset;
+    uint64_t length;
+};
+
+bool map_order(const MapExtent& a, const MapExtent& b) {
+    int ids = a.file_id.compare(b.file_id);
+    return ids < 0 || (ids == 0 && a.offset < b.offset);
+}
+
+// map files are the magic followed by records of
+// id length (uint16), id, file size, offset, physical offset and length (uint64)
+class MapWriter {
+public:
+    MapWriter(const std::string& path) : path_(path), file_(fopen(path.c_str(), "wb")) {
+        if (file_ == nullptr || fwrite(MAP_MAGIC, sizeof(MAP_MAGIC), 1, file_) != 1) {
+            throw std::runtime_error("can't write extent map " + path);
+        }
+    }
+    ~MapWriter() {
+        if (file_ != nullptr) {
+            fclose(file_);
+        }
+    }
+
+    void write(const MapExtent& extent) {
+        uint16_t id_len = extent.file_id.size();
+        uint64_t fields[4] = {extent.file_size, extent.offset, extent.phys_offset, extent.length};
+        if (fwrite(&id_len, sizeof(id_len), 1, file_) != 1 ||
+                fwrite(extent.file_id.data(), 1, id_len, file_) != id_len ||
+                fwrite(fields, sizeof(fields), 1, file_) != 1) {
+            throw std::runtime_error("can't write extent map " + path_);
+        }
+    }
+
+    void close() {
+        int result = fclose(file_);
+        file_ = nullptr;
+        if (result != 0) {
+            throw std::runtime_error("can't write extent map " + path_);
+        }
+    }
+
+private:
+    std::string path_;
+    FILE* file_;
+};
+
+class MapReader {
+public:
+    MapReader(const std::string& path) : path_(path), file_(fopen(path.c_str(), "rb")) {
+        char magic[sizeof(MAP_MAGIC)];
+        if (file_ == nullptr || fread(magic, sizeof(magic), 1, file_) != 1 ||
+                memcmp(magic, MAP_MAGIC, sizeof(magic))) {
+            throw std::runtime_error("can't read extent map " + path);
+        }
+    }
+    ~MapReader() {
+        if (file_ != nullptr) {
+            fclose(file_);
+        }
+    }
+
+    // false at the end of the map
+    bool read(MapExtent& extent) {
+        uint16_t id_len;
+        uint64_t fields[4];
+        if (fread(&id_len, sizeof(id_len), 1, file_) != 1) {
+            if (ferror(file_)) {
+                throw std::runtime_error("can't read extent map " + path_);
+            }
+            return false;
+        }
+        extent.file_id.resize(id_len);
+        if ((id_len && fread(&extent.file_id[0], 1, id_len, file_) != id_len) ||
+                fread(fields, sizeof(fields), 1, file_) != 1) {
+            throw std::runtime_error("truncated extent map " + path_);
+        }
+        extent.file_size = fields[0];
+        extent.offset = fields[1];
+        extent.phys_offset = fields[2];
+        extent.length = fields[3];
+        return true;
+    }
+
+private:
+    std::string path_;
+    FILE* file_;
+};
+
+// removes the file when it goes out of scope
+class TempFile {
+public:
+    TempFile(const std::string& path) : path_(path) {}
+    ~TempFile() {
+        unlink(path_.c_str());
+    }
+
+    const std::string& path() const {
+        return path_;
+    }
+
+private:
+    std::string path_;
+};
+
+// external sort: extents are sorted in memory_limit sized runs, spilled to
+// temporary files and merged into the map when the scan ends
+class MapSorter {
+public:
+    MapSorter(const std::string& path, std::function<std::string()> temp_path, size_t memory_limit)
+            : path_(path), temp_path_(temp_path), memory_limit_(memory_limit), memory_used_(0) {}
+
+    void add(const std::string& file_id, uint64_t file_size, uint64_t offset,
+             uint64_t phys_offset, uint64_t length) {
+        if (length == 0) {
+            return;
+        }
+        extents_.push_back({file_id, file_size, offset, phys_offset, length});
+        memory_used_ += sizeof(MapExtent) + file_id.size();
+        if (memory_used_ >= memory_limit_) {
+            runs_.emplace_back(new TempFile(temp_path_()));
+            write_run(runs_.back()->path());
+        }
+    }
+
+    void finish() {
+        if (runs_.empty()) {
+            write_run(path_);
+            return;
+        }
+        if (!extents_.empty()) {
+            runs_.emplace_back(new TempFile(temp_path_()));
+            write_run(runs_.back()->path());
+        }
+
+        // k-way merge of the runs, each at its smallest unmerged extent
+        std::vector<std::unique_ptr<MapReader>> readers;
+        std::vector<MapExtent> heads(runs_.size());
+        auto later = [&heads](size_t a, size_t b) {
+            return map_order(heads[b], heads[a]);
+        };
+        std::priority_queue<size_t, std::vector<size_t>, decltype(later)> queue(later);
+        for (size_t run = 0; run < runs_.size(); run++) {
+            readers.emplace_back(new MapReader(runs_[run]->path()));
+            if (readers[run]->read(heads[run])) {
+                queue.push(run);
+            }
+        }
+        MapWriter writer(path_);
+        while (!queue.empty()) {
+            size_t run = queue.top();
+            queue.pop();
+            writer.write(heads[run]);
+            if (readers[run]->read(heads[run])) {
+                queue.push(run);
+            }
+        }
+        writer.close();
+        runs_.clear();
+    }
+
+private:
+    void write_run(const std::string& path) {
+        std::sort(extents_.begin(), extents_.end(), map_order);
+        MapWriter writer(path);
+        for (const MapExtent& extent : extents_) {
+            writer.write(extent);
+        }
+        writer.close();
+        extents_.clear();
+        memory_used_ = 0;
+    }
+
+    std::string path_;
+    std::function<std::string()> temp_path_;
+    size_t memory_limit_;
+    size_t memory_used_;
+    std::vector<MapExtent> extents_;
+    std::vector<std::unique_ptr<TempFile>> runs_;
+};
+
+// the extents of one file at a time from a sorted map
+class FileStream {
+public:
+    FileStream(const std::string& path) : reader_(path) {
+        has_next_ = reader_.read(next_);
+    }
+
+    // false at the end of the map
+    bool next_file() {
+        extents_.clear();
+        if (!has_next_) {
+            return false;
+        }
+        file_id_ = next_.file_id;
+        do {
+            extents_.push_back(next_);
+            has_next_ = reader_.read(next_);
+        } while (has_next_ && next_.file_id == file_id_);
+        return true;
+    }
+
+    const std::string& file_id() const {
+        return file_id_;
+    }
+    uint64_t file_size() const {
+        return extents_.front().file_size;
+    }
+    const std::vector<MapExtent>& extents() const {
+        return extents_;
+    }
+
+private:
+    MapReader reader_;
+    MapExtent next_;
+    bool has_next_;
+    std::string file_id_;
+    std::vector<MapExtent> extents_;
+};
+
+// position in the extents of a file, extents may be consumed in parts
+class ExtentCursor {
+public:
+    ExtentCursor(const std::vector<MapExtent>& extents) : extents_(extents), index_(0), done_(0) {}
+
+    bool end() const {
+        return index_ == extents_.size();
+    }
+    uint64_t start() const {
+        return extents_[index_].offset + done_;
+    }
+    uint64_t stop() const {
+        return extents_[index_].offset + extents_[index_].length;
+    }
+    uint64_t phys_offset() const {
+        return extents_[index_].phys_offset + done_;
+    }
+    void advance(uint64_t length) {
+        done_ += length;
+        if (done_ == extents_[index_].length) {
+            index_++;
+            done_ = 0;
+        }
+    }
+
+private:
+    const std::vector<MapExtent>& extents_;
+    size_t index_;
+    uint64_t done_;
+};
+
+// holds back range changes to join the adjacent ones
+class ChangeQueue {
+public:
+    ChangeQueue(const ChangeFunc& printChange) : print_change_(printChange), pending_(false) {}
+
+    void add(const ExtentChange& change) {
+        if (pending_ && last_.kind == change.kind && last_.file_id == change.file_id &&
+                last_.offset + last_.length == change.offset &&
+                (change.kind == ExtentChange::RANGE_ADDED || last_.old_phys_offset + last_.length == change.old_phys_offset) &&
+                (change.kind == ExtentChange::RANGE_REMOVED || last_.new_phys_offset + last_.length == change.new_phys_offset)) {
+            last_.length += change.length;
+            return;
+        }
+        flush();
+        last_ = change;
+        pending_ = true;
+    }
+
+    void flush() {
+        if (pending_) {
+            print_change_(last_);
+            pending_ = false;
+        }
+    }
+
+private:
+    const ChangeFunc& print_change_;
+    bool pending_;
+    ExtentChange last_;
+};
+
+void diff_file(const FileStream& old_file, const FileStream& new_file, ChangeQueue& changes) {
+    ExtentChange change;
+    change.file_id = old_file.file_id();
+    change.old_size = old_file.file_size();
+    change.new_size = new_file.file_size();
+    change.offset = change.length = change.old_phys_offset = change.new_phys_offset = 0;
+    if (change.old_size != change.new_size) {
+        change.kind = ExtentChange::FILE_RESIZED;
+        changes.add(change);
+    }
+
+    // both extent lists are in offset order, walk them in pieces that are mapped the same way
+    ExtentCursor old_cursor(old_file.extents()), new_cursor(new_file.extents());
+    while (!old_cursor.end() || !new_cursor.end()) {
+        change.offset = old_cursor.end() ? new_cursor.start() :
+                new_cursor.end() ? old_cursor.start() : std::min(old_cursor.start(), new_cursor.start());
+        change.old_phys_offset = change.new_phys_offset = 0;
+        if (new_cursor.end() || (!old_cursor.end() && old_cursor.start() < new_cursor.start())) {
+            change.kind = ExtentChange::RANGE_REMOVED;
+            change.length = (new_cursor.end() ? old_cursor.stop() : std::min(old_cursor.stop(), new_cursor.start())) - change.offset;
+            change.old_phys_offset = old_cursor.phys_offset();
+            old_cursor.advance(change.length);
+            changes.add(change);
+        } else if (old_cursor.end() || new_cursor.start() < old_cursor.start()) {
+            change.kind = ExtentChange::RANGE_ADDED;
+            change.length = (old_cursor.end() ? new_cursor.stop() : std::min(new_cursor.stop(), old_cursor.start())) - change.offset;
+            change.new_phys_offset = new_cursor.phys_offset();
+            new_cursor.advance(change.length);
+            changes.add(change);
+        } else {
+            change.length = std::min(old_cursor.stop(), new_cursor.stop()) - change.offset;
+            change.old_phys_offset = old_cursor.phys_offset();
+            change.new_phys_offset = new_cursor.phys_offset();
+            old_cursor.advance(change.length);
+            new_cursor.advance(change.length);
+            if (change.old_phys_offset != change.new_phys_offset) {
+                change.kind = ExtentChange::RANGE_RELOCATED;
+                changes.add(change);
+            }
+        }
+    }
+}
+
+ExtentChange file_change(ExtentChange::Kind kind, const std::string& file_id, uint64_t old_size, uint64_t new_size) {
+    ExtentChange change;
+    change.kind = kind;
+    change.file_id = file_id;
+    change.old_size = old_size;
+    change.new_size = new_size;
+    change.offset = change.length = change.old_phys_offset = change.new_phys_offset = 0;
+    return change;
+}
+
+}
+
+SnapshotDiff::SnapshotDiff(const DiffOptions& options) : options_(options) {}
+
+std::string SnapshotDiff::temp_path() {
+    std::string path = options_.temp_dir + "/fs_stat_map.XXXXXX";
+    int fd = mkstemp(&path[0]);
+    if (fd < 0) {
+        throw std::runtime_error("can't create a file in " + options_.temp_dir);
+    }
+    close(fd);
+    return path;
+}
+
+void SnapshotDiff::SaveMap(std::shared_ptr<Disk> disk, const std::string& map_path) {
+    MapSorter sorter(map_path, [this]() { return temp_path(); }, options_.memory_limit);
+    BlockFunc addBlock = [&sorter](std::string file_id, uint64_t file_size,
+            uint64_t offset, uint64_t phys_offset, uint64_t len) {
+        sorter.add(file_id, file_size, offset, phys_offset, len);
+    };
+    MetadataFunc skipMetadata = [](uint32_t, uint64_t, bool, bool, int64_t, int64_t, int64_t) {};
+
+    FSParser file_sys(disk);
+    file_sys.Parse(addBlock, skipMetadata);
+    sorter.finish();
+}
+
+void SnapshotDiff::Diff(std::shared_ptr<Disk> old_disk, std::shared_ptr<Disk> new_disk, const ChangeFunc& printChange) {
+    TempFile old_map(temp_path());
+    SaveMap(old_disk, old_map.path());
+    Diff(old_map.path(), new_disk, printChange);
+}
+
+void SnapshotDiff::Diff(const std::string& old_map_path, std::shared_ptr<Disk> new_disk, const ChangeFunc& printChange) {
+    TempFile new_map(temp_path());
+    SaveMap(new_disk, new_map.path());
+    Diff(old_map_path, new_map.path(), printChange);
+}
+
+void SnapshotDiff::Diff(const std::string& old_map_path, const std::string& new_map_path, const ChangeFunc& printChange) {
+    FileStream old_files(old_map_path), new_files(new_map_path);
+    ChangeQueue changes(printChange);
+    bool has_old = old_files.next_file(), has_new = new_files.next_file();
+    while (has_old || has_new) {
+        int order = !has_old ? 1 : !has_new ? -1 : old_files.file_id().compare(new_files.file_id());
+        if (order < 0) {
+            changes.add(file_change(ExtentChange::FILE_REMOVED, old_files.file_id(), old_files.file_size(), 0));
+            has_old = old_files.next_file();
+        } else if (order > 0) {
+            changes.add(file_change(ExtentChange::FILE_ADDED, new_files.file_id(), 0, new_files.file_size()));
+            has_new = new_files.next_file();
+        } else {
+            diff_file(old_files, new_files, changes);
+            has_old = old_files.next_file();
+            has_new = new_files.next_file();
+        }
+    }
+    changes.flush();
+}
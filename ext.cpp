@@ -1,7 +1,14 @@
 #include "FS.h"
 
+#include <cassert>
 #include <memory>
 
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
 enum ExtConsts {
     COMPAT_DIR_PREALLOC = 0x1,
     COMPAT_IMAGIC_INODES = 0x2,
@@ -25,7 +32,7 @@ enum ExtConsts {
     INCOMPAT_FLEX_BG = 0x200,
     INCOMPAT_EA_INODE = 0x400,
     INCOMPAT_DIRDATA = 0x1000,
-    INCOMPAT_BG_USE_META_CSUM = 0x2000,
+    INCOMPAT_CSUM_SEED = 0x2000,
     INCOMPAT_LARGEDIR = 0x4000,
     INCOMPAT_INLINE_DATA = 0x8000,
 
@@ -43,20 +50,26 @@ enum ExtConsts {
 
     EXT4_BG_INODE_UNINIT = 0x1,
     EXT4_BG_BLOCK_UNINIT = 0x2,
-    EXT4_BG_INODE_ZEROED = 0x4
+    EXT4_BG_INODE_ZEROED = 0x4,
+
+    SCHED_WINDOW = 256, // inodes whose metadata reads are issued together
+    FLEX_UNIT_MAX = 16, // most groups of a flex group analized as one unit
+    VERIFY_BATCH = 4 // inodes whose checksums are computed together
 };
 
-Ext::Ext(std::shared_ptr<Disk> disk) {
+Ext::Ext(std::shared_ptr<Disk> disk) : dir_inode_(0), cluster_run_() {
     disk_ = disk;
+    sched_.reset(new ReadScheduler());
+    set_read_depth(ReadPipeline::DEFAULT_DEPTH);
 
     std::unique_ptr<ExtSuperBlock> sb(new ExtSuperBlock);
-    disk_->read(sb.get(), 1024, 1024);
+    read(ScanStats::READ_SUPERBLOCK, sb.get(), 1024, 1024);
 
     inodes_count_ = sb->s_inodes_count;
     blocks_count_ = sb->s_blocks_count_lo;
     first_block_ = sb->s_first_data_block;
     block_size_ = 1 << (sb->s_log_block_size + 10);
-    cluster_size_ = 1 << (sb->s_log_cluster_size);
+    cluster_size_ = 1;
     blocks_per_group_ = sb->s_blocks_per_group;
     frags_per_group_ = sb->s_clusters_per_group;
     inodes_per_group_ = sb->s_inodes_per_group;
@@ -69,26 +82,38 @@ Ext::Ext(std::shared_ptr<Disk> disk) {
         feature_ro_compat_ = sb->s_feature_ro_compat;
         desc_size_ = INCOMPAT_64BIT & feature_incompat_ ?
                 sb->s_desc_size : 32;
-        first_meta_bg_ = INCOMPAT_META_BG & feature_incompat_ ?
-                sb->s_first_meta_bg : (blocks_count_ - 1) / blocks_per_group_ + 1;
-
         if (INCOMPAT_64BIT & feature_incompat_) {
             blocks_count_ += ((uint64_t) sb->s_blocks_count_hi << 32);
         }
+        if (RO_COMPAT_BIGALLOC & feature_ro_compat_) {
+            // a group is sized in clusters, everything in the inodes is still in blocks
+            cluster_size_ = 1 << (sb->s_log_cluster_size - sb->s_log_block_size);
+            blocks_per_group_ = frags_per_group_ * cluster_size_;
+        }
+        // the first group of the first meta_bg
+        first_meta_bg_ = INCOMPAT_META_BG & feature_incompat_ ?
+                sb->s_first_meta_bg * (block_size_ / desc_size_) : unit_count();
 
         groups_per_flex_ = 1 << sb->s_log_groups_per_flex;
         kbytes_written_ = sb->s_kbytes_written;
+        csum_seed_ = INCOMPAT_CSUM_SEED & feature_incompat_ ?
+                sb->s_checksum_seed : crc32c(~0, sb->s_uuid, sizeof(sb->s_uuid));
     } else {
         inode_size_ = 128;
         feature_compat_ = feature_incompat_ = feature_ro_compat_ = 0;
         desc_size_ = 32;
-        first_meta_bg_ = (blocks_count_ - 1) / blocks_per_group_ + 1;
+        first_meta_bg_ = unit_count();
         kbytes_written_ = 0;
         groups_per_flex_ = 1;
+        csum_seed_ = 0;
     }
+    memcpy(uuid_, sb->s_uuid, sizeof(uuid_));
+    memcpy(backup_bgs_, sb->s_backup_bgs, sizeof(backup_bgs_));
+    sb_csum_valid_ = !(RO_COMPAT_METADATA_CSUM & feature_ro_compat_) ||
+            sb->s_checksum == crc32c(~0, sb.get(), offsetof(ExtSuperBlock, s_checksum));
 
     if (~(~feature_incompat_ | INCOMPAT_FILETYPE | INCOMPAT_META_BG | INCOMPAT_RECOVER | // TODO: deal with RECOVER
-            INCOMPAT_EXTENTS | INCOMPAT_64BIT | INCOMPAT_FLEX_BG | INCOMPAT_INLINE_DATA)) {
+            INCOMPAT_EXTENTS | INCOMPAT_64BIT | INCOMPAT_FLEX_BG | INCOMPAT_INLINE_DATA | INCOMPAT_CSUM_SEED)) {
         throw std::runtime_error("can't read this fs, some incompatible features are not supported");
     }
 }
@@ -96,64 +121,540 @@ Ext::Ext(std::shared_ptr<Disk> disk) {
 Ext::~Ext() {
 }
 
-void Ext::Parse(BlockFunc& printBlock, MetadataFunc& printMetadata) {
-    ExtGroupDesc bg_desc;
-
-    int bg_per_metabg = block_size_ / desc_size_;
-    uint64_t meta_bg_start = first_meta_bg_ ? first_meta_bg_ : bg_per_metabg;
+void Ext::Parse(BlockFunc& printBlock, MetadataFunc& printMetadata, const ScanFilter& filter) {
+    uint64_t first, end;
+    begin_scan(filter, first, end);
+    parse_units(printBlock, printMetadata, first, end);
+}
 
-    // first groups in the beginning are in the same "meta_bg"
-    for (int bg = 0; bg < meta_bg_start; bg++) {
-        disk_->read(&bg_desc, desc_size_, (first_block_ + 1) * block_size_ + bg * desc_size_);
-        analize_desc(printBlock, printMetadata, bg_desc, bg);
+void Ext::begin_scan(const ScanFilter& filter, uint64_t& first, uint64_t& end) {
+    filter_ = filter;
+    first = end = 0;
+    if (filter_.last_file < filter_.first_file || filter_.last_file == 0) {
+        return;
     }
+    check_superblock();
+    load_groups();
 
-    // process metablocks
-    for (uint64_t metabg_first_bg = meta_bg_start; blocks_per_group_ * metabg_first_bg < blocks_count_;
-            metabg_first_bg += bg_per_metabg) {
-        for (int bg = 0; bg < bg_per_metabg && blocks_per_group_ * (metabg_first_bg + bg - 1) < blocks_count_; bg++) {
-            disk_->read(&bg_desc, desc_size_, (1 + first_block_ + metabg_first_bg * blocks_per_group_) * block_size_ +
-                    bg * desc_size_);
-            analize_desc(printBlock, printMetadata, bg_desc, metabg_first_bg + bg);
+    // groups holding only inodes outside of the filter are skipped
+    end = std::min<uint64_t>((filter_.last_file - 1) / inodes_per_group_ + 1, unit_count());
+    first = std::min<uint64_t>(filter_.first_file ? (filter_.first_file - 1) / inodes_per_group_ : 0, end);
+}
+
+void Ext::parse_units(BlockFunc& printBlock, MetadataFunc& printMetadata, uint64_t first, uint64_t end) {
+    // a flex group at a time, whose bitmaps and inode tables lie next to each other
+    uint64_t flex = INCOMPAT_FLEX_BG & feature_incompat_ ?
+            std::min<uint64_t>(groups_per_flex_, FLEX_UNIT_MAX) : 1;
+    for (uint64_t unit_first = first; unit_first < end;) {
+        uint64_t unit_end = std::min(end, (unit_first / flex + 1) * flex);
+        // the next unit's tables are hinted to the disk while this one is analized
+        for (uint64_t bg = unit_end; bg < end && bg < unit_end + flex; bg++) {
+            prefetch_group(bg);
         }
+        analize_groups(printBlock, printMetadata, unit_first, unit_end - unit_first);
+        unit_first = unit_end;
     }
 }
 
-void Ext::analize_desc(BlockFunc& printBlock, MetadataFunc& printMetadata, const ExtGroupDesc& desc, uint32_t group_num) {
-    if (desc.bg_flags & EXT4_BG_INODE_UNINIT) {
+// The whole descriptor table, a block at a time. The blocks are scheduled as
+// many as the budget holds, so that those next to each other are read at once.
+void Ext::load_groups() {
+    uint64_t count = unit_count();
+    if (groups_.flags.size() == count) {
         return;
     }
+    groups_.inode_bitmap.resize(count);
+    groups_.inode_table.resize(count);
+    groups_.used_inodes.resize(count);
+    groups_.flags.resize(count);
+    groups_.csum_valid.resize(count);
 
+    uint64_t per_block = block_size_ / desc_size_;
+    Arena::Scope scope(scratch_);
+    char* block = scratch_.allocate(block_size_);
+    for (uint64_t first = 0; first < count;) {
+        uint64_t end = first;
+        while (end < count && sched_->add(ScanStats::READ_GROUP_DESC, desc_offset(end),
+                std::min(per_block, count - end) * desc_size_)) {
+            end += per_block;
+        }
+        issue_reads();
+        if (end == first) {
+            end += per_block; // a block at a time, read on demand
+        }
+        for (uint64_t group = first; group < end && group < count; group += per_block) {
+            uint64_t descs = std::min(per_block, count - group);
+            read(ScanStats::READ_GROUP_DESC, block, descs * desc_size_, desc_offset(group));
+            for (uint64_t i = 0; i < descs; i++) {
+                parse_desc(*(const ExtGroupDesc*) (block + i * desc_size_), group + i);
+            }
+        }
+        sched_->reset();
+        first = end;
+    }
+}
+
+void Ext::parse_desc(const ExtGroupDesc& desc, uint64_t group_num) {
     uint64_t inode_bitmap_off = desc.bg_inode_bitmap_lo;
     uint64_t inode_table_off = desc.bg_inode_table_lo;
-    uint32_t free_inodes_count = desc.bg_free_inodes_count_lo;
-
-    if ((INCOMPAT_64BIT & feature_incompat_) && desc_size_ > 32) {
+    uint32_t unused_inodes = 0;
+    bool wide = (INCOMPAT_64BIT & feature_incompat_) && desc_size_ > 32;
+    if (wide) {
         inode_bitmap_off += ((uint64_t) desc.bg_inode_bitmap_hi << 32);
         inode_table_off += ((uint64_t) desc.bg_inode_table_hi << 32);
-        free_inodes_count += ((uint32_t) desc.bg_free_inodes_count_hi << 16);
+    }
+    // only kept up to date where the descriptors have checksums
+    if ((RO_COMPAT_GDT_CSUM | RO_COMPAT_METADATA_CSUM) & feature_ro_compat_) {
+        unused_inodes = desc.bg_itable_unused_lo + (wide ? (uint32_t) desc.bg_itable_unused_hi << 16 : 0);
     }
 
-    int byte_count = inodes_per_group_ / 8 < block_size_ ? inodes_per_group_ / 8 : block_size_;
-    
-    std::unique_ptr<char> bitmap_chunk(new char[byte_count]);
-    std::unique_ptr<char> inode(new char[inode_size_]);
-
-    for (uint64_t k = 0; 8 * k < inodes_per_group_; k += byte_count) {
-        disk_->read(bitmap_chunk.get(), byte_count, (first_block_ + inode_bitmap_off) * block_size_ + k);
-        for (int i = 0; i < byte_count; i++) {
-            if (bitmap_chunk.get()[i]) {
-                for (int j = 0; j < 8; j++) {
-                    if (bitmap_chunk.get()[i] & (1 << j)) {
-                        disk_->read(inode.get(), inode_size_,
-                                (first_block_ + inode_table_off) * block_size_ + inode_size_ * (8 * i + j));
-                        analize_inode(printBlock, printMetadata, (ExtInode*) inode.get(),
-                                group_num * inodes_per_group_ + 8 * (k + i) + j + 1);
+    groups_.inode_bitmap[group_num] = inode_bitmap_off * block_size_;
+    groups_.inode_table[group_num] = inode_table_off * block_size_;
+    groups_.used_inodes[group_num] = unused_inodes < inodes_per_group_ ? inodes_per_group_ - unused_inodes : 0;
+    groups_.flags[group_num] = desc.bg_flags;
+    groups_.csum_valid[group_num] = desc_csum_valid(desc, group_num);
+}
+
+// false for groups without inodes in use, or with a bad descriptor when verifying
+bool Ext::group_in_use(uint64_t group_num) {
+    if (groups_.flags[group_num] & EXT4_BG_INODE_UNINIT || groups_.used_inodes[group_num] == 0) {
+        return false;
+    }
+    if (!verify_checksums_ || !((RO_COMPAT_METADATA_CSUM | RO_COMPAT_GDT_CSUM) & feature_ro_compat_)) {
+        return true;
+    }
+    return count_checksum(groups_.csum_valid[group_num]);
+}
+
+// whether the group starts with a copy of the superblock and the descriptors
+bool Ext::group_has_super(uint64_t group_num) {
+    if (group_num == 0) {
+        return true;
+    }
+    if (COMPAT_SPARSE_SUPER2 & feature_compat_) {
+        return group_num == backup_bgs_[0] || group_num == backup_bgs_[1];
+    }
+    if (group_num == 1 || !(RO_COMPAT_SPARSE_SUPER & feature_ro_compat_)) {
+        return true;
+    }
+    for (uint64_t base : {3, 5, 7}) {
+        uint64_t power = base;
+        while (power < group_num) {
+            power *= base;
+        }
+        if (power == group_num) {
+            return true;
+        }
+    }
+    return false;
+}
+
+uint64_t Ext::desc_offset(uint64_t group_num) {
+    int bg_per_metabg = block_size_ / desc_size_;
+    uint64_t meta_bg_start = first_meta_bg_ ? first_meta_bg_ : bg_per_metabg;
+
+    // first groups in the beginning are in the same "meta_bg", right after the superblock's block,
+    // which is block 1 with 1K blocks even where bigalloc makes the first data block 0
+    if (group_num < meta_bg_start) {
+        return (1024 / block_size_ + 1) * block_size_ + group_num * desc_size_;
+    }
+
+    // the rest are described by the first group of their metablock, after its superblock if it has one
+    uint64_t metabg_first_bg = meta_bg_start + (group_num - meta_bg_start) / bg_per_metabg * bg_per_metabg;
+    return (first_block_ + metabg_first_bg * blocks_per_group_ + group_has_super(metabg_first_bg)) * block_size_ +
+            (group_num - metabg_first_bg) * desc_size_;
+}
+
+uint64_t Ext::buffer_bytes() {
+    return scratch_.capacity() + sched_->capacity() + groups_.flags.capacity() *
+            (2 * sizeof(uint64_t) + sizeof(uint32_t) + sizeof(uint16_t) + sizeof(char));
+}
+
+// inodes per window, fewer if the budget can't hold an inode and a tree block for each
+int Ext::window_capacity() {
+    uint64_t fitting = sched_->budget() / (inode_size_ + block_size_);
+    return fitting < 1 ? 1 : std::min<uint64_t>(fitting, SCHED_WINDOW);
+}
+
+uint64_t Ext::unit_count() {
+    return (blocks_count_ - first_block_ + blocks_per_group_ - 1) / blocks_per_group_;
+}
+
+uint64_t Ext::unit_bytes() {
+    return block_size_ + (uint64_t) inodes_per_group_ * inode_size_;
+}
+
+bool Ext::lookup_file(uint64_t file_num, BlockFunc& printBlock, MetadataFunc& printMetadata) {
+    if (file_num == 0 || file_num > inodes_count_) {
+        return false;
+    }
+    check_superblock();
+    load_groups();
+    uint32_t group_num = (file_num - 1) / inodes_per_group_;
+    uint32_t index = (file_num - 1) % inodes_per_group_;
+    if (!group_in_use(group_num) || index >= groups_.used_inodes[group_num]) {
+        return false;
+    }
+
+    char bitmap_byte;
+    read(ScanStats::READ_INODE_BITMAP, &bitmap_byte, 1, groups_.inode_bitmap[group_num] + index / 8);
+    if (!(bitmap_byte & (1 << index % 8))) {
+        return false;
+    }
+
+    Arena::Scope scope(scratch_);
+    char* inode = scratch_.allocate(inode_size_);
+    uint64_t inode_offset = groups_.inode_table[group_num] + (uint64_t) inode_size_ * index;
+    sched_->add(ScanStats::READ_INODE, inode_offset, inode_size_);
+    issue_reads();
+    read(ScanStats::READ_INODE, inode, inode_size_, inode_offset);
+    if (((ExtInode*) inode)->i_links_count == 0) {
+        sched_->reset();
+        return false;
+    }
+
+    filter_ = ScanFilter();
+    uint32_t inode_num = file_num;
+    // a window of one, so the tree is still read level by level in disk order
+    return analize_window(printBlock, printMetadata, &inode_num, &inode_offset, 1, true) == 1;
+}
+
+// groups of one flex group, their bitmaps read at once and their inodes walked in
+// windows that go on from one group's table into the next
+void Ext::analize_groups(BlockFunc& printBlock, MetadataFunc& printMetadata, uint64_t first_group, uint64_t count) {
+    size_t bitmap_size = inodes_per_group_ / 8;
+
+    Arena::Scope scope(scratch_);
+    char* bitmaps = scratch_.allocate(count * bitmap_size);
+    // bytes of each bitmap to read, those covering inodes ever used and accepted by the filter
+    uint32_t* bitmap_first = (uint32_t*) scratch_.allocate(count * sizeof(uint32_t));
+    uint32_t* bitmap_end = (uint32_t*) scratch_.allocate(count * sizeof(uint32_t));
+    uint32_t* inode_nums = (uint32_t*) scratch_.allocate(SCHED_WINDOW * sizeof(uint32_t));
+    uint64_t* inode_offsets = (uint64_t*) scratch_.allocate(SCHED_WINDOW * sizeof(uint64_t));
+
+    for (uint64_t g = 0; g < count; g++) {
+        uint64_t group_first_inode = (first_group + g) * inodes_per_group_ + 1;
+        bitmap_first[g] = bitmap_end[g] = 0;
+        if (!group_in_use(first_group + g) || filter_.last_file < group_first_inode) {
+            continue;
+        }
+        bitmap_end[g] = (groups_.used_inodes[first_group + g] + 7) / 8;
+        if (filter_.last_file - group_first_inode < 8 * (uint64_t) bitmap_end[g]) {
+            bitmap_end[g] = (filter_.last_file - group_first_inode) / 8 + 1;
+        }
+        if (filter_.first_file > group_first_inode) {
+            bitmap_first[g] = std::min<uint64_t>((filter_.first_file - group_first_inode) / 8, bitmap_end[g]);
+        }
+        if (bitmap_first[g] < bitmap_end[g]) {
+            sched_->add(ScanStats::READ_INODE_BITMAP, groups_.inode_bitmap[first_group + g] + bitmap_first[g],
+                    bitmap_end[g] - bitmap_first[g]);
+        }
+    }
+    issue_reads();
+    for (uint64_t g = 0; g < count; g++) {
+        if (bitmap_first[g] < bitmap_end[g]) {
+            read(ScanStats::READ_INODE_BITMAP, bitmaps + g * bitmap_size + bitmap_first[g],
+                    bitmap_end[g] - bitmap_first[g], groups_.inode_bitmap[first_group + g] + bitmap_first[g]);
+        }
+    }
+    sched_->reset();
+
+    int window_size = 0;
+    int window_end = window_capacity();
+    for (uint64_t g = 0; g < count; g++) {
+        const char* bitmap = bitmaps + g * bitmap_size;
+        uint32_t used_inodes = groups_.used_inodes[first_group + g];
+        uint64_t table_offset = groups_.inode_table[first_group + g];
+        uint64_t group_first_inode = (first_group + g) * inodes_per_group_ + 1;
+        for (size_t i = bitmap_first[g]; i < bitmap_end[g]; i++) {
+            if (!bitmap[i]) {
+                continue;
+            }
+            for (int j = 0; j < 8; j++) {
+                uint64_t index = 8 * i + j;
+                if (bitmap[i] & (1 << j) && index < used_inodes && filter_.accepts_file(group_first_inode + index)) {
+                    inode_nums[window_size] = group_first_inode + index;
+                    inode_offsets[window_size] = table_offset + inode_size_ * index;
+                    if (++window_size == window_end) {
+                        analize_window(printBlock, printMetadata, inode_nums, inode_offsets, window_size, false);
+                        window_size = 0;
                     }
                 }
             }
         }
     }
+    analize_window(printBlock, printMetadata, inode_nums, inode_offsets, window_size, false);
+}
+
+// the inode bitmap and the part of the inode table that has ever been used
+void Ext::prefetch_group(uint64_t group_num) {
+    if (groups_.flags[group_num] & EXT4_BG_INODE_UNINIT || groups_.used_inodes[group_num] == 0) {
+        return;
+    }
+    disk_->prefetch(groups_.inode_bitmap[group_num], block_size_);
+    disk_->prefetch(groups_.inode_table[group_num], (uint64_t) groups_.used_inodes[group_num] * inode_size_);
+}
+
+// the number of inodes analized, the others failed their checksums. Their metadata is
+// printed before their extents if print_metadata is set.
+int Ext::analize_window(BlockFunc& printBlock, MetadataFunc& printMetadata, const uint32_t* inode_nums,
+        const uint64_t* inode_offsets, int count, bool print_metadata) {
+    Arena::Scope scope(scratch_);
+    char* inode = scratch_.allocate(VERIFY_BATCH * inode_size_);
+    char* valid = scratch_.allocate(count); // inodes whose checksums, and those of their extent blocks, match
+
+    // the inodes, then the extent tree and indirect blocks level by level, each level in disk order
+    for (int i = 0; i < count; i++) {
+        sched_->add(ScanStats::READ_INODE, inode_offsets[i], inode_size_);
+    }
+    issue_reads();
+
+    for (int first = 0; first < count; first += VERIFY_BATCH) {
+        int batch = count - first < VERIFY_BATCH ? count - first : VERIFY_BATCH;
+        for (int i = 0; i < batch; i++) {
+            read(ScanStats::READ_INODE, inode + i * inode_size_, inode_size_, inode_offsets[first + i]);
+        }
+        verify_inodes(inode, inode_nums + first, batch, valid + first);
+        for (int i = 0; i < batch; i++) {
+            if (valid[first + i]) {
+                schedule_inode((ExtInode*) (inode + i * inode_size_), inode_nums[first + i], first + i);
+            }
+        }
+    }
+    for (size_t level_start = 0; level_start < nodes_.size();) {
+        issue_reads();
+        size_t level_end = nodes_.size();
+        for (size_t i = level_start; i < level_end; i++) {
+            schedule_children(nodes_[i], valid);
+        }
+        level_start = level_end;
+    }
+    nodes_.clear();
+
+    int analized = 0;
+    for (int i = 0; i < count; i++) {
+        if (!valid[i]) {
+            continue;
+        }
+        read(ScanStats::READ_INODE, inode, inode_size_, inode_offsets[i]);
+        if (print_metadata) {
+            print_inode_metadata(printMetadata, (ExtInode*) inode, inode_nums[i]);
+        }
+        analize_inode(printBlock, printMetadata, (ExtInode*) inode, inode_nums[i]);
+        analized++;
+    }
+    sched_->reset();
+
+    if (!dir_runs_.empty()) {
+        analize_dirs();
+    }
+    return analized;
+}
+
+// names in the window's directories for the path index, their blocks read in disk order
+void Ext::analize_dirs() {
+    Arena::Scope scope(scratch_);
+    char* block = scratch_.allocate(block_size_);
+
+    for (const DirRun& run : dir_runs_) {
+        for (uint64_t i = 0; i < run.count; i++) {
+            sched_->add(ScanStats::READ_DIR_BLOCK, (run.block + i) * block_size_, block_size_);
+        }
+    }
+    issue_reads();
+
+    for (const DirRun& run : dir_runs_) {
+        for (uint64_t i = 0; i < run.count; i++) {
+            read(ScanStats::READ_DIR_BLOCK, block, block_size_, (run.block + i) * block_size_);
+            analize_dir_entries(run.dir_inode, block, block_size_);
+        }
+    }
+    dir_runs_.clear();
+    sched_->reset();
+}
+
+void Ext::analize_dir_entries(uint32_t dir_inode, const char* entries, size_t size) {
+    for (size_t offset = 0; offset + sizeof(ExtDirEntry) <= size;) {
+        const ExtDirEntry* entry = (const ExtDirEntry*) (entries + offset);
+        if (entry->rec_len < sizeof(ExtDirEntry) || offset + entry->rec_len > size) {
+            break;
+        }
+        offset += entry->rec_len;
+        // unused entries, htree nodes and checksum tails have inode 0
+        if (entry->inode == 0 || sizeof(ExtDirEntry) + entry->name_len > entry->rec_len) {
+            continue;
+        }
+        if (entry->name[0] == '.' && (entry->name_len == 1 || (entry->name_len == 2 && entry->name[1] == '.'))) {
+            if (entry->name_len == 2 && entry->inode == dir_inode) {
+                paths_->add(dir_inode, dir_inode, "", 0); // the root
+            }
+            continue;
+        }
+        paths_->add(entry->inode, dir_inode, entry->name, entry->name_len);
+    }
+}
+
+void Ext::schedule_node(const MetaNode& node) {
+    ScanStats::ReadSite site = node.depth < 0 ? ScanStats::READ_EXTENT_NODE : ScanStats::READ_INDIRECT_BLOCK;
+    // extent blocks over the budget are still walked, read on demand, so that the
+    // whole tree is verified before the inode is analized
+    if (sched_->add(site, node.block * block_size_, block_size_) ||
+            (node.depth < 0 && verify_checksums_ && (RO_COMPAT_METADATA_CSUM & feature_ro_compat_))) {
+        nodes_.push_back(node);
+    }
+}
+
+void Ext::schedule_inode(const ExtInode* inode, uint32_t inode_num, int window_index) {
+    uint64_t file_size = inode->i_size_lo + ((uint64_t) inode->i_size_high << 32);
+    if (inode->i_links_count == 0 || !filter_.accepts_size(file_size) || (0x10000000 & inode->i_flags)) {
+        return;
+    }
+
+    if (0x80000 & inode->i_flags) {
+        const ExtExtentHeader* extent_header = (const ExtExtentHeader*) inode->i_block;
+        if (extent_header->eh_depth == 0) {
+            return;
+        }
+        uint32_t csum_seed = inode_csum_seed(inode_num, inode->i_generation);
+        for (uint32_t i = 1; i <= extent_header->eh_entries && 12 * (i + 1) <= sizeof(inode->i_block); ++i) {
+            const ExtExtentIndex* index = (const ExtExtentIndex*) ((const char*) inode->i_block + 12 * i);
+            schedule_node({index->ei_leaf_lo + ((uint64_t) index->ei_leaf_hi << 32), 0, 0, -1, window_index, csum_seed});
+        }
+    } else {
+        uint64_t file_blocks = (file_size + block_size_ - 1) / block_size_;
+        uint64_t first_offset = 12, span = 1;
+        for (int i = 1; i <= 3 && first_offset < file_blocks; ++i) {
+            span *= block_size_ / 4;
+            if (inode->i_block[11 + i]) {
+                schedule_node({inode->i_block[11 + i], first_offset, file_blocks, i, window_index, 0});
+            }
+            first_offset += span;
+        }
+    }
+}
+
+void Ext::schedule_children(MetaNode node, char* valid) {
+    if (!valid[node.window_index]) {
+        return;
+    }
+    Arena::Scope scope(scratch_);
+    char* block = scratch_.allocate(block_size_);
+
+    if (node.depth < 0) {
+        read(ScanStats::READ_EXTENT_NODE, block, block_size_, node.block * block_size_);
+        if (!verify_extent_block(block, node.csum_seed)) {
+            valid[node.window_index] = 0;
+            return;
+        }
+        const ExtExtentHeader* extent_header = (const ExtExtentHeader*) block;
+        if (extent_header->eh_depth == 0) {
+            return;
+        }
+        for (uint32_t i = 1; i <= extent_header->eh_entries && 12 * (i + 1) <= block_size_; ++i) {
+            const ExtExtentIndex* index = (const ExtExtentIndex*) (block + 12 * i);
+            schedule_node({index->ei_leaf_lo + ((uint64_t) index->ei_leaf_hi << 32), 0, 0, -1,
+                    node.window_index, node.csum_seed});
+        }
+    } else if (node.depth > 1) {
+        read(ScanStats::READ_INDIRECT_BLOCK, block, block_size_, node.block * block_size_);
+        uint64_t span = 1;
+        for (int i = 1; i < node.depth; i++) {
+            span *= block_size_ / 4;
+        }
+        for (uint32_t record = 0; record < block_size_ / 4; record++) {
+            uint64_t first_offset = node.first_offset + record * span;
+            if (first_offset >= node.file_blocks) {
+                break;
+            }
+            uint32_t child = ((uint32_t*) block)[record];
+            if (child) {
+                schedule_node({child, first_offset, node.file_blocks, node.depth - 1, node.window_index, 0});
+            }
+        }
+    }
+}
+
+void Ext::check_superblock() {
+    if (verify_checksums_ && !sb_csum_valid_) {
+        throw std::runtime_error("superblock checksum mismatch");
+    }
+}
+
+uint32_t Ext::inode_csum_seed(uint32_t inode_num, uint32_t generation) {
+    uint64_t num_generation = inode_num | (uint64_t) generation << 32;
+    return crc32c(csum_seed_, &num_generation, 8);
+}
+
+// true if verification is off or the descriptor has no checksum
+bool Ext::desc_csum_valid(const ExtGroupDesc& desc, uint32_t group_num) {
+    if (!((RO_COMPAT_METADATA_CSUM | RO_COMPAT_GDT_CSUM) & feature_ro_compat_)) {
+        return true;
+    }
+    const char* bytes = (const char*) &desc;
+    const size_t csum_offset = offsetof(ExtGroupDesc, bg_checksum);
+    const uint16_t zero = 0;
+
+    if (RO_COMPAT_METADATA_CSUM & feature_ro_compat_) {
+        uint32_t crc = crc32c(csum_seed_, &group_num, 4);
+        crc = crc32c(crc, bytes, csum_offset);
+        crc = crc32c(crc, &zero, 2);
+        crc = crc32c(crc, bytes + csum_offset + 2, desc_size_ - csum_offset - 2);
+        return (crc & 0xffff) == desc.bg_checksum;
+    }
+    uint16_t crc = crc16(~0, uuid_, sizeof(uuid_));
+    crc = crc16(crc, &group_num, 4);
+    crc = crc16(crc, bytes, csum_offset);
+    crc = crc16(crc, bytes + csum_offset + 2, desc_size_ - csum_offset - 2);
+    return crc == desc.bg_checksum;
+}
+
+// up to VERIFY_BATCH inodes read one after another into inodes, their checksums
+// computed side by side. The checksum fields are zeroed on the way.
+void Ext::verify_inodes(char* inodes, const uint32_t* inode_nums, int count, char* valid) {
+    if (!verify_checksums_ || !(RO_COMPAT_METADATA_CSUM & feature_ro_compat_)) {
+        memset(valid, 1, count);
+        return;
+    }
+    uint32_t crcs[VERIFY_BATCH];
+    uint32_t stored[VERIFY_BATCH];
+    uint32_t masks[VERIFY_BATCH];
+    const void* data[VERIFY_BATCH];
+    assert(count > 0 && count <= VERIFY_BATCH);
+
+    for (int i = 0; i < count; i++) {
+        ExtInode* inode = (ExtInode*) (inodes + (size_t) i * inode_size_);
+        stored[i] = inode->osd2.linux2.l_i_checksum_lo;
+        inode->osd2.linux2.l_i_checksum_lo = 0;
+        masks[i] = 0xffff;
+        // the high half is there if the extra inode space reaches it
+        if (inode_size_ > 128 && inode->i_extra_isize >= offsetof(ExtInode, i_checksum_hi) + 2 - 128) {
+            stored[i] |= (uint32_t) inode->i_checksum_hi << 16;
+            inode->i_checksum_hi = 0;
+            masks[i] = 0xffffffff;
+        }
+        crcs[i] = inode_csum_seed(inode_nums[i], inode->i_generation);
+        data[i] = inode;
+    }
+    crc32c_multi(crcs, data, inode_size_, count);
+
+    for (int i = 0; i < count; i++) {
+        valid[i] = count_checksum((crcs[i] & masks[i]) == stored[i]);
+    }
+}
+
+// the tail after eh_max entries holds the crc32c of the block up to it
+bool Ext::verify_extent_block(const char* block, uint32_t csum_seed) {
+    if (!verify_checksums_ || !(RO_COMPAT_METADATA_CSUM & feature_ro_compat_)) {
+        return true;
+    }
+    const ExtExtentHeader* header = (const ExtExtentHeader*) block;
+    size_t tail = sizeof(ExtExtentHeader) + sizeof(ExtExtent) * header->eh_max;
+    if (header->eh_magic != 0xf30a || header->eh_entries > header->eh_max || tail + 4 > block_size_) {
+        return count_checksum(false);
+    }
+    uint32_t stored;
+    memcpy(&stored, block + tail, 4);
+    return count_checksum(crc32c(csum_seed, block, tail) == stored);
 }
 
 void Ext::print_inode_metadata(MetadataFunc& printMetadata, const ExtInode* inode, uint32_t inode_num) {
@@ -176,10 +677,50 @@ void Ext::print_inode_metadata(MetadataFunc& printMetadata, const ExtInode* inod
         crtime = crtime + (inode->i_crtime_extra % 4) * 0x100000000 + (inode->i_crtime_extra >> 2);
     }
     
+    SCAN_STAT_TIMER(callback_ns);
     printMetadata(inode_num, file_size, compressed_flag, encrypt_flag, ctime, mtime, atime);
 }
 
+void Ext::print_extent(BlockFunc& printBlock, uint32_t inode_num, uint64_t file_size,
+        uint64_t start_offset, uint64_t start_phys_offset, uint64_t len) {
+    if (dir_inode_) {
+        dir_runs_.push_back({dir_inode_, start_phys_offset, len});
+    }
+    if (cluster_size_ > 1) {
+        // bigalloc gives a file whole clusters, a block keeps its offset in the cluster in both numberings
+        uint64_t head = std::min<uint64_t>(start_phys_offset % cluster_size_, start_offset);
+        start_offset -= head;
+        start_phys_offset -= head;
+        len = (head + len + cluster_size_ - 1) / cluster_size_ * cluster_size_;
+
+        ClusterRun& run = cluster_run_;
+        if (run.len && start_phys_offset >= run.phys_offset && start_phys_offset <= run.phys_offset + run.len &&
+                start_offset - run.offset == start_phys_offset - run.phys_offset) {
+            // rows split by an unwritten extent or a hole inside a cluster
+            run.len = std::max(run.len, start_phys_offset + len - run.phys_offset);
+            return;
+        }
+        flush_cluster_run(printBlock);
+        run = {inode_num, file_size, start_offset, start_phys_offset, len};
+        return;
+    }
+    if (filter_.accepts_range(start_phys_offset, len)) {
+        SCAN_STAT_TIMER(callback_ns);
+        printBlock(std::to_string(inode_num), file_size, start_offset, start_phys_offset, len);
+    }
+}
+
+void Ext::flush_cluster_run(BlockFunc& printBlock) {
+    ClusterRun& run = cluster_run_;
+    if (run.len && filter_.accepts_range(run.phys_offset, run.len)) {
+        SCAN_STAT_TIMER(callback_ns);
+        printBlock(std::to_string(run.inode_num), run.file_size, run.offset, run.phys_offset, run.len);
+    }
+    run.len = 0;
+}
+
 void Ext::analize_inode(BlockFunc& printBlock, MetadataFunc& printMetadata, const ExtInode* inode, uint32_t inode_num) {
+    SCAN_STAT_ADD(inodes_visited, 1);
     if (inode->i_links_count == 0) {
         return;
     }
@@ -187,34 +728,44 @@ void Ext::analize_inode(BlockFunc& printBlock, MetadataFunc& printMetadata, cons
     uint64_t file_size = inode->i_size_lo;
     file_size += ((uint64_t) inode->i_size_high << 32); // in ext2/3 should be 0
 
+    if (!filter_.accepts_size(file_size)) {
+        return;
+    }
+
     bool extents_flag = 0x80000 & inode->i_flags;
     bool huge_file_flag = 0x40000 & inode->i_flags;
     bool ea_inode_flag = 0x200000 & inode->i_flags; // TODO: do we need extended attributes?
     bool inline_data_flag = 0x10000000 & inode->i_flags;
+    bool dir_flag = paths_ && (inode->i_mode & 0xF000) == 0x4000;
 
     // PERF: approx. -20% time
     // print_inode_metadata(printMetadata, inode, inode_num);
 
     if (inline_data_flag) {
-        // there are no blocks for this inode
+        // there are no blocks for this inode, an inline directory starts with its parent's number
+        if (dir_flag) {
+            analize_dir_entries(inode_num, (const char*) inode->i_block + 4, sizeof(inode->i_block) - 4);
+        }
         return;
     }
+    dir_inode_ = dir_flag ? inode_num : 0;
 
     // all values are in blocks
-    uint32_t curr_offset = 0, start_offset = 0, start_phys_offset = 0, next_phys_offset = 0;
+    uint64_t curr_offset = 0, start_offset = 0, start_phys_offset = 0, next_phys_offset = 0;
 
     if (extents_flag) {
         // extents
         ExtExtentHeader* extent_header = (ExtExtentHeader*) inode->i_block;
         int entry_count = extent_header->eh_entries;
         int depth = extent_header->eh_depth;
+        SCAN_STAT_ADD(tree_depth[depth < ScanStats::MAX_DEPTH ? depth : ScanStats::MAX_DEPTH - 1], 1);
         for (int i = 1; i <= entry_count; ++i) {
             analize_extent_node(printBlock, curr_offset, (char*) inode->i_block + 12 * i,
                     start_offset, start_phys_offset, next_phys_offset, file_size, depth, inode_num);
         }
 
         if (start_phys_offset != 0) {
-            printBlock(std::to_string(inode_num), file_size, start_offset,
+            print_extent(printBlock, inode_num, file_size, start_offset,
                     start_phys_offset, curr_offset - start_offset);
         }
     } else {
@@ -224,29 +775,103 @@ void Ext::analize_inode(BlockFunc& printBlock, MetadataFunc& printMetadata, cons
                     start_offset, start_phys_offset, next_phys_offset, file_size, 0, inode_num);
         }
 
-        for (int i = 1; i <= 3 && curr_offset * block_size_ < file_size; ++i) {
-            analize_block(printBlock, curr_offset, inode->i_block[11 + i],
-                    start_offset, start_phys_offset, next_phys_offset, file_size, i, inode_num);
+        // one past the deepest indirect block the file reaches
+        int depth = 1;
+        for (; depth <= 3 && curr_offset * block_size_ < file_size; ++depth) {
+            analize_block(printBlock, curr_offset, inode->i_block[11 + depth],
+                    start_offset, start_phys_offset, next_phys_offset, file_size, depth, inode_num);
         }
+        SCAN_STAT_ADD(tree_depth[depth - 1], 1);
 
         if (start_phys_offset != 0) {
-            printBlock(std::to_string(inode_num), file_size, start_offset,
+            print_extent(printBlock, inode_num, file_size, start_offset,
                     start_phys_offset, curr_offset - start_offset);
         }
     }
+    flush_cluster_run(printBlock);
+    dir_inode_ = 0;
 }
 
-inline uint32_t power(uint32_t base, int power) {
-    uint32_t potential = 1;
+inline uint64_t power(uint64_t base, int power) {
+    uint64_t potential = 1;
     for (int i = 0; i < power; i++) {
         potential *= base;
     }
     return potential;
 }
 
+namespace {
+
+// number of leading pointers that continue the run started by pointers[0],
+// each one the block right after the one before it
+size_t pointer_run(const uint32_t* pointers, size_t count) {
+    size_t i = 1;
+#ifdef __AVX2__
+    const __m256i one = _mm256_set1_epi32(1);
+    const __m256i zero = _mm256_setzero_si256();
+    for (; i + 8 <= count; i += 8) {
+        __m256i curr = _mm256_loadu_si256((const __m256i*) (pointers + i));
+        __m256i prev = _mm256_loadu_si256((const __m256i*) (pointers + i - 1));
+        __m256i next = _mm256_andnot_si256(_mm256_cmpeq_epi32(curr, zero),
+                _mm256_cmpeq_epi32(curr, _mm256_add_epi32(prev, one)));
+        unsigned mask = _mm256_movemask_ps(_mm256_castsi256_ps(next));
+        if (mask != 0xff) {
+            return i + __builtin_ctz(~mask);
+        }
+    }
+#endif
+#ifdef __SSE2__
+    const __m128i one4 = _mm_set1_epi32(1);
+    const __m128i zero4 = _mm_setzero_si128();
+    for (; i + 4 <= count; i += 4) {
+        __m128i curr = _mm_loadu_si128((const __m128i*) (pointers + i));
+        __m128i prev = _mm_loadu_si128((const __m128i*) (pointers + i - 1));
+        __m128i next = _mm_andnot_si128(_mm_cmpeq_epi32(curr, zero4),
+                _mm_cmpeq_epi32(curr, _mm_add_epi32(prev, one4)));
+        unsigned mask = _mm_movemask_ps(_mm_castsi128_ps(next));
+        if (mask != 0xf) {
+            return i + __builtin_ctz(~mask);
+        }
+    }
+#endif
+    for (; i < count && pointers[i] != 0 && pointers[i] == pointers[i - 1] + 1; i++) {
+    }
+    return i;
+}
+
+// number of leading zero pointers (holes)
+size_t pointer_hole(const uint32_t* pointers, size_t count) {
+    size_t i = 0;
+#ifdef __AVX2__
+    for (; i + 8 <= count; i += 8) {
+        __m256i curr = _mm256_loadu_si256((const __m256i*) (pointers + i));
+        unsigned mask = _mm256_movemask_ps(_mm256_castsi256_ps(
+                _mm256_cmpeq_epi32(curr, _mm256_setzero_si256())));
+        if (mask != 0xff) {
+            return i + __builtin_ctz(~mask);
+        }
+    }
+#endif
+#ifdef __SSE2__
+    for (; i + 4 <= count; i += 4) {
+        __m128i curr = _mm_loadu_si128((const __m128i*) (pointers + i));
+        unsigned mask = _mm_movemask_ps(_mm_castsi128_ps(
+                _mm_cmpeq_epi32(curr, _mm_setzero_si128())));
+        if (mask != 0xf) {
+            return i + __builtin_ctz(~mask);
+        }
+    }
+#endif
+    for (; i < count && pointers[i] == 0; i++) {
+    }
+    return i;
+}
+
+}
+
 // mapping only applicable for lower 2^32 blocks
-void Ext::analize_block(BlockFunc& printBlock, uint32_t& curr_offset, uint32_t block_phys_offset,
-        uint32_t& start_offset, uint32_t& start_phys_offset, uint32_t& next_phys_offset,
+void Ext::analize_block(BlockFunc& printBlock, uint64_t& curr_offset, uint32_t block_phys_offset,
+        uint64_t& start_offset, uint64_t& start_phys_offset, uint64_t& next_phys_offset,
         uint64_t file_size, int depth, uint32_t inode_num) {
 
     if (curr_offset * block_size_ >= file_size) {
@@ -256,7 +881,7 @@ void Ext::analize_block(BlockFunc& printBlock, uint32_t& curr_offset, uint32_t b
     if (block_phys_offset == 0) {
         // everything in this subtree is zeroes
         if (start_phys_offset != 0) {
-            printBlock(std::to_string(inode_num), file_size, start_offset,
+            print_extent(printBlock, inode_num, file_size, start_offset,
                     start_phys_offset, curr_offset - start_offset);
         }
 
@@ -272,7 +897,7 @@ void Ext::analize_block(BlockFunc& printBlock, uint32_t& curr_offset, uint32_t b
             next_phys_offset++;
         } else {
             if (start_phys_offset != 0) {
-                printBlock(std::to_string(inode_num), file_size, start_offset,
+                print_extent(printBlock, inode_num, file_size, start_offset,
                     start_phys_offset, curr_offset - start_offset);
             }
             start_offset = curr_offset;
@@ -283,18 +908,63 @@ void Ext::analize_block(BlockFunc& printBlock, uint32_t& curr_offset, uint32_t b
 
     } else {
         // interior node of extent tree
-        std::unique_ptr<char> block(new char[block_size_]);
-        disk_->read(block.get(), block_size_, block_phys_offset * block_size_);
+        Arena::Scope scope(scratch_);
+        char* block = scratch_.allocate(block_size_);
+        read(ScanStats::READ_INDIRECT_BLOCK, block, block_size_, block_phys_offset * block_size_);
 
+        if (depth == 1) {
+            analize_pointers(printBlock, curr_offset, (const uint32_t*) block, start_offset,
+                    start_phys_offset, next_phys_offset, file_size, inode_num);
+            return;
+        }
         for (uint32_t record = 0; record < block_size_ && curr_offset * block_size_ < file_size; record += 4) {
-            analize_block(printBlock, curr_offset, *((uint32_t*) (block.get() + record)), start_offset, start_phys_offset,
+            analize_block(printBlock, curr_offset, *((uint32_t*) (block + record)), start_offset, start_phys_offset,
                     next_phys_offset, file_size, depth - 1, inode_num);
         }
     }
 }
 
-void Ext::analize_extent_node(BlockFunc& printBlock, uint32_t& curr_offset, char* entry,
-        uint32_t& start_offset, uint32_t& start_phys_offset, uint32_t& next_phys_offset,
+// the data block pointers of an indirect block, a run of consecutive blocks
+// or holes at a time
+void Ext::analize_pointers(BlockFunc& printBlock, uint64_t& curr_offset, const uint32_t* pointers,
+        uint64_t& start_offset, uint64_t& start_phys_offset, uint64_t& next_phys_offset,
+        uint64_t file_size, uint32_t inode_num) {
+
+    uint64_t file_blocks = (file_size + block_size_ - 1) / block_size_;
+    size_t count = block_size_ / 4;
+    if (file_blocks - curr_offset < count) {
+        count = file_blocks - curr_offset;
+    }
+
+    for (size_t i = 0; i < count;) {
+        size_t len;
+        if (pointers[i] == 0) {
+            len = pointer_hole(pointers + i, count - i);
+            if (start_phys_offset != 0) {
+                print_extent(printBlock, inode_num, file_size, start_offset,
+                        start_phys_offset, curr_offset - start_offset);
+            }
+            start_offset = -1;
+            next_phys_offset = start_phys_offset = 0;
+        } else {
+            len = pointer_run(pointers + i, count - i);
+            if (pointers[i] != next_phys_offset) {
+                if (start_phys_offset != 0) {
+                    print_extent(printBlock, inode_num, file_size, start_offset,
+                            start_phys_offset, curr_offset - start_offset);
+                }
+                start_offset = curr_offset;
+                start_phys_offset = pointers[i];
+            }
+            next_phys_offset = (uint64_t) pointers[i + len - 1] + 1;
+        }
+        curr_offset += len;
+        i += len;
+    }
+}
+
+void Ext::analize_extent_node(BlockFunc& printBlock, uint64_t& curr_offset, char* entry,
+        uint64_t& start_offset, uint64_t& start_phys_offset, uint64_t& next_phys_offset,
         uint64_t file_size, int depth, uint32_t inode_num) {
 
     if (curr_offset * block_size_ >= file_size) {
@@ -309,25 +979,37 @@ void Ext::analize_extent_node(BlockFunc& printBlock, uint32_t& curr_offset, char
         // read header and go through entries
         ExtExtentIndex* extent_index = (ExtExtentIndex*) entry;
         uint64_t node_phys_offset = extent_index->ei_leaf_lo + ((uint64_t) extent_index->ei_leaf_hi << 32);
-        std::unique_ptr<char> node_block(new char[block_size_]);
-        disk_->read(node_block.get(), block_size_, node_phys_offset * block_size_);
+        Arena::Scope scope(scratch_);
+        char* node_block = scratch_.allocate(block_size_);
+        read(ScanStats::READ_EXTENT_NODE, node_block, block_size_, node_phys_offset * block_size_);
 
-        ExtExtentHeader* extent_header = (ExtExtentHeader*) node_block.get();
+        ExtExtentHeader* extent_header = (ExtExtentHeader*) node_block;
         int entry_count = extent_header->eh_entries;
         int depth = extent_header->eh_depth;
         for (int i = 1; i <= entry_count; i++) {
-            analize_extent_node(printBlock, curr_offset, node_block.get() + 12 * i,
+            analize_extent_node(printBlock, curr_offset, node_block + 12 * i,
                     start_offset, start_phys_offset, next_phys_offset, file_size, depth, inode_num);
         }
     }
 }
 
-void Ext::analize_extent(BlockFunc& printBlock, uint32_t& curr_offset, const ExtExtent* extent,
-        uint32_t& start_offset, uint32_t& start_phys_offset, uint32_t& next_phys_offset,
+void Ext::analize_extent(BlockFunc& printBlock, uint64_t& curr_offset, const ExtExtent* extent,
+        uint64_t& start_offset, uint64_t& start_phys_offset, uint64_t& next_phys_offset,
         uint64_t file_size, uint32_t inode_num) {
 
     uint16_t len = extent->ee_len;
 
+    if (extent->ee_block != curr_offset) {
+        // a hole before this extent, the row can't go over it
+        if (start_phys_offset != 0) {
+            print_extent(printBlock, inode_num, file_size, start_offset,
+                    start_phys_offset, curr_offset - start_offset);
+        }
+        start_offset = -1;
+        next_phys_offset = start_phys_offset = 0;
+        curr_offset = extent->ee_block;
+    }
+
     if (len <= 32768) {
         // initialized extent
         uint64_t extent_phys_offset = extent->ee_start_lo + ((uint64_t) extent->ee_start_hi << 32);
@@ -338,7 +1020,7 @@ void Ext::analize_extent(BlockFunc& printBlock, uint32_t& curr_offset, const Ext
         } else {
             // row breaks
             if (start_phys_offset != 0) {
-                printBlock(std::to_string(inode_num), file_size, start_offset,
+                print_extent(printBlock, inode_num, file_size, start_offset,
                     start_phys_offset, curr_offset - start_offset);
             }
             start_offset = curr_offset;
@@ -351,7 +1033,7 @@ void Ext::analize_extent(BlockFunc& printBlock, uint32_t& curr_offset, const Ext
         // uninitialized extent
         len -= 32768;
         if (start_phys_offset != 0) {
-            printBlock(std::to_string(inode_num), file_size, start_offset,
+            print_extent(printBlock, inode_num, file_size, start_offset,
                     start_phys_offset, curr_offset - start_offset);
         }
 
@@ -10,22 +10,172 @@
 
 
 #include <stdint.h>
+#include <atomic>
 #include <string>
 #include <fstream>
 #include <functional>
 #include <memory>
+#include <mutex>
+#include <vector>
+#include <algorithm>
+#include <chrono>
+#include <unordered_map>
 
 
 using BlockFunc = std::function<void(std::string, uint64_t,
-        uint32_t, uint32_t, int32_t)>;
+        uint64_t, uint64_t, uint64_t)>;
 using MetadataFunc = std::function<void(uint32_t, uint64_t,
         bool, bool, int64_t, int64_t, int64_t)>;
+using PathFunc = std::function<void(uint64_t, const std::string&)>;
+
+// Restricts a scan, a default-constructed filter lets everything through.
+// File numbers are inode numbers for ext and base MFT record numbers for NTFS,
+// physical blocks are fs blocks for ext and clusters for NTFS.
+struct ScanFilter {
+    ScanFilter() : first_file(0), last_file(UINT64_MAX), min_file_size(0),
+            first_phys_block(0), last_phys_block(UINT64_MAX) {}
+
+    bool accepts_file(uint64_t file_num) const {
+        return first_file <= file_num && file_num <= last_file;
+    }
+    bool accepts_size(uint64_t file_size) const {
+        return file_size >= min_file_size;
+    }
+    bool accepts_attr(uint32_t type) const {
+        return attr_types.empty() ||
+                std::find(attr_types.begin(), attr_types.end(), type) != attr_types.end();
+    }
+    bool accepts_range(uint64_t phys_offset, uint64_t len) const {
+        return phys_offset <= last_phys_block && phys_offset + len > first_phys_block;
+    }
+
+    uint64_t first_file;
+    uint64_t last_file;
+    uint64_t min_file_size;
+    std::vector<uint32_t> attr_types; // NTFS attribute types, ignored by ext
+    uint64_t first_phys_block;
+    uint64_t last_phys_block;
+};
+
+struct SampleOptions {
+    SampleOptions() : fraction(0.02), byte_budget(0), seed(0) {}
+
+    double fraction;      // share of ext block groups / NTFS bitmap chunks to visit
+    uint64_t byte_budget; // if set, caps the metadata bytes to read instead of fraction
+    uint64_t seed;
+};
+
+// point estimate with its 95% confidence interval
+struct Estimate {
+    double value;
+    double low;
+    double high;
+};
+
+// Files are inodes for ext and attribute streams for NTFS, only files owning
+// at least one extent are counted.
+struct SampleReport {
+    uint64_t units_total;
+    uint64_t units_sampled;
+    uint64_t files_sampled;
+    Estimate file_count;
+    Estimate extents_per_file;
+    Estimate file_size;
+    // share of files with size in [2^i, 2^(i+1)), bucket 0 also holds empty files
+    std::vector<Estimate> size_distribution;
+};
+
+struct MemoryReport {
+    uint64_t budget;       // 0 if not limited
+    uint64_t peak_buffers; // scratch and read-ahead buffers of the parser
+    uint64_t peak_rss;     // of the whole process, taken at the end of the last Parse
+};
+
+// Metadata checksums checked by a parser since it was created, see
+// FSParser::set_verify_checksums.
+struct ChecksumReport {
+    ChecksumReport() : checked(0), failed(0) {}
+
+    uint64_t checked;
+    uint64_t failed; // group descriptors, inodes, extent blocks and NTFS records skipped
+};
+
+// Progress of a long Parse is saved after every interval_units block groups
+// (ext) or bitmap chunks (NTFS) along with the caller's output offsets. If
+// path exists when Parse starts, the outputs are rewound to the saved offsets
+// and the scan continues after the last saved unit; a checkpoint saved with
+// another filter is rejected. The file is removed once the scan completes.
+struct CheckpointOptions {
+    CheckpointOptions() : interval_units(64) {}
+
+    std::string path;
+    uint64_t interval_units;
+    // flushes the outputs and returns their offsets
+    std::function<std::vector<uint64_t>()> sync_outputs;
+    // truncates the outputs to offsets from sync_outputs
+    std::function<void(const std::vector<uint64_t>&)> rewind_outputs;
+};
+
+// Scan counters and cumulative timers in ns. They are collected only by a library
+// built with -DFS_STAT_SCAN_STATS (make -f LibMakefile SCAN_STATS=1) and stay zero
+// otherwise. Relaxed atomics, so another thread may sample them while Parse runs.
+struct ScanStats {
+    enum ReadSite {
+        READ_SUPERBLOCK,
+        READ_GROUP_DESC,
+        READ_INODE_BITMAP,
+        READ_INODE,
+        READ_EXTENT_NODE,
+        READ_INDIRECT_BLOCK,
+        READ_DIR_BLOCK,
+        READ_BOOT_SECTOR,
+        READ_MFT_RECORD,
+        READ_MFT_BITMAP,
+        READ_ATTR_LIST,
+        READ_SITE_COUNT
+    };
+    static const int MAX_DEPTH = 8;
+
+    ScanStats() { reset(); }
+    void reset();
+    static const char* site_name(ReadSite site);
+    // time outside of disk reads, callbacks and fixups
+    uint64_t decode_ns() const;
+
+    std::atomic<uint64_t> reads[READ_SITE_COUNT];
+    std::atomic<uint64_t> read_bytes[READ_SITE_COUNT];
+    std::atomic<uint64_t> read_ns[READ_SITE_COUNT];
+    std::atomic<uint64_t> scheduled_hits; // reads served by the ReadScheduler
+    std::atomic<uint64_t> inodes_visited;
+    std::atomic<uint64_t> records_visited;
+    std::atomic<uint64_t> tree_depth[MAX_DEPTH]; // files by ext extent tree or block map depth
+    std::atomic<uint64_t> attr_list_resolutions;
+    std::atomic<uint64_t> callback_ns;
+    std::atomic<uint64_t> fixup_ns;
+    std::atomic<uint64_t> parse_ns;
+};
+
+class ReadScheduler;
+class ReadPipeline;
+class PathIndex;
+
+enum FSType {
+    FS_UNKNOWN,
+    FS_EXT,
+    FS_NTFS
+};
 
 class Disk {
 public:
     virtual void read_blocks(void* buffer, size_t size, uint64_t offset) = 0;
     virtual size_t get_block_size() = 0;
-    void read(void* buffer, size_t size, uint64_t offset);
+    // any byte range, by default through read_blocks of the blocks it touches
+    virtual void read(void* buffer, size_t size, uint64_t offset);
+    // a hint that the byte range will be read soon, ignored by default
+    virtual void prefetch(uint64_t, size_t) {}
+    // whether read and prefetch may run on several threads at once. Only then does a
+    // parser read ahead on background threads (see FSParser::set_read_depth).
+    virtual bool concurrent_reads() { return false; }
 };
 
 class DiskOverRegFile: public Disk {
@@ -35,25 +185,433 @@ public:
 
     void read_blocks(void* buffer, size_t size, uint64_t offset);
     size_t get_block_size();
+    void prefetch(uint64_t offset, size_t size);
+    bool concurrent_reads();
 
 private:
-    std::ifstream file_;
+    int fd_;
+};
+
+struct DiskGeometry {
+    uint32_t logical_sector;  // unit of addressing, the disk's block size
+    uint32_t physical_sector; // unit of the device's own I/O, reads are aligned to it
+    uint64_t size;            // in bytes
+    bool direct;              // page cache bypassed
 };
 
+// Block device or large file read with O_DIRECT, so that a scan of a live volume
+// doesn't evict the page cache of other workloads. Every read is widened to whole
+// physical sectors and goes through a pool of aligned buffers unless the caller's
+// buffer already is one. Falls back to buffered reads where O_DIRECT isn't supported.
+class DiskOverDevice: public Disk {
+public:
+    DiskOverDevice(const std::string& path, bool direct = true);
+    ~DiskOverDevice();
+
+    void read_blocks(void* buffer, size_t size, uint64_t offset);
+    size_t get_block_size();
+    void read(void* buffer, size_t size, uint64_t offset);
+    // to the page cache, so only without O_DIRECT
+    void prefetch(uint64_t offset, size_t size);
+    bool concurrent_reads();
+    const DiskGeometry& geometry() const {
+        return geometry_;
+    }
+
+private:
+    char* take_buffer();
+    void give_buffer(char* buffer);
+    void read_aligned(char* buffer, size_t size, uint64_t offset);
+
+    int fd_;
+    DiskGeometry geometry_;
+    std::mutex pool_mutex_;
+    std::vector<char*> free_buffers_;
+};
+
+// DiskOverDevice for block devices, DiskOverRegFile otherwise
+std::shared_ptr<Disk> OpenDisk(const std::string& path);
+
+// [offset, offset + size) bytes of another disk, e.g. one partition of a whole-disk image
+class DiskWindow: public Disk {
+public:
+    DiskWindow(std::shared_ptr<Disk> disk, uint64_t offset, uint64_t size);
+
+    void read_blocks(void* buffer, size_t size, uint64_t offset);
+    size_t get_block_size();
+    void read(void* buffer, size_t size, uint64_t offset);
+    void prefetch(uint64_t offset, size_t size);
+    bool concurrent_reads();
+
+private:
+    std::shared_ptr<Disk> disk_;
+    uint64_t first_block_;
+    uint64_t block_count_;
+};
+
+struct ThrottleOptions {
+    ThrottleOptions() : bytes_per_second(0), reads_per_second(0), latency_target_us(0), idle_priority(false) {}
+
+    // whether reads have to go through a Throttle
+    bool limited() const {
+        return bytes_per_second || reads_per_second || latency_target_us || idle_priority;
+    }
+
+    uint64_t bytes_per_second; // 0 for no cap
+    uint64_t reads_per_second;
+    // if set, the byte rate adapts to keep reads under it: halved when one takes longer,
+    // raised step by step while none does, never above bytes_per_second
+    uint64_t latency_target_us;
+    bool idle_priority; // scans run in the idle I/O scheduling class, see IdlePriorityScope
+};
+
+struct ThrottleReport {
+    uint64_t bytes;
+    uint64_t reads;
+    uint64_t read_ns;    // spent in the disk
+    uint64_t wait_ns;    // held back by the throttle
+    uint64_t byte_rate;  // allowed now, 0 if not limited
+    uint64_t slow_reads; // over the latency target
+};
+
+// Token buckets for bytes and reads, shared by the disks of one device. The
+// options may change while scans run, they apply from the next read.
+class Throttle {
+public:
+    Throttle(const ThrottleOptions& options = ThrottleOptions());
+    void set_options(const ThrottleOptions& options);
+    ThrottleOptions options() const;
+    ThrottleReport report() const;
+
+    // blocks until a read of size bytes is allowed
+    void acquire(size_t size);
+    // the read took ns, feeds the latency target
+    void complete(size_t size, uint64_t ns);
+
+private:
+    double byte_rate() const;
+
+    mutable std::mutex mutex_;
+    ThrottleOptions options_;
+    double rate_; // adapted byte rate, 0 if not limited
+    double byte_tokens_;
+    double read_tokens_;
+    std::chrono::steady_clock::time_point refilled_;
+    std::chrono::steady_clock::time_point adjusted_;
+    ThrottleReport report_;
+};
+
+// Reads of another disk paced by a Throttle, in pieces of at most 256 KB so that
+// a big read doesn't go out as one burst. Prefetch hints are dropped, the reads
+// they'd start would go around the throttle.
+class ThrottledDisk: public Disk {
+public:
+    ThrottledDisk(std::shared_ptr<Disk> disk, std::shared_ptr<Throttle> throttle);
+
+    void read_blocks(void* buffer, size_t size, uint64_t offset);
+    size_t get_block_size();
+    void read(void* buffer, size_t size, uint64_t offset);
+    bool concurrent_reads();
+
+private:
+    std::shared_ptr<Disk> disk_;
+    std::shared_ptr<Throttle> throttle_;
+};
+
+// Puts the calling thread in the idle I/O scheduling class while it lives, then
+// back in the class it had. Threads started meanwhile, like the read pipeline of
+// an FSParser constructed in the scope, inherit the class.
+class IdlePriorityScope {
+public:
+    IdlePriorityScope(bool idle);
+    ~IdlePriorityScope();
+
+private:
+    long previous_; // -1 if left as it was
+};
+
+struct Partition {
+    uint32_t number; // as numbered by the OS, MBR logical partitions start from 5
+    uint64_t offset; // in bytes
+    uint64_t size;
+    FSType filesystem;
+};
+
+// GPT or MBR (with logical) partitions of a whole-disk image. Empty if the
+// image has no partition table or is a filesystem itself.
+std::vector<Partition> FindPartitions(std::shared_ptr<Disk> disk);
+
 
 class FSParser {
 public:
-    virtual void Parse(BlockFunc& printBlock, MetadataFunc& printMetadata);
+    void Parse(BlockFunc& printBlock, MetadataFunc& printMetadata);
+    virtual void Parse(BlockFunc& printBlock, MetadataFunc& printMetadata, const ScanFilter& filter);
+    void Parse(BlockFunc& printBlock, MetadataFunc& printMetadata, const ScanFilter& filter,
+               const CheckpointOptions& checkpoint);
+    SampleReport Sample(const SampleOptions& options);
+    // extents and metadata of one file (ext inode, NTFS base record) without a scan,
+    // false if it isn't in use
+    bool Lookup(uint64_t file_num, BlockFunc& printBlock, MetadataFunc& printMetadata);
+    const ScanStats& stats() const;
+    static bool stats_enabled();
+    static FSType Detect(std::shared_ptr<Disk> disk);
+    // caps the parser's scratch and read-ahead memory, 0 for the defaults. Over the
+    // budget, reads are batched in smaller windows and then issued one by one.
+    void set_memory_budget(uint64_t bytes);
+    MemoryReport memory() const;
+    // printPath(file_num, path) for every named file accepted by the filter once a Parse
+    // ends, empty to turn off. Names come from the directories (ext) and $FILE_NAME
+    // attributes (NTFS) the scan visits, an ancestor it didn't name shows up as
+    // <file_num>. A resumed checkpointed Parse rereads the units it skips for their names.
+    void set_path_output(const PathFunc& printPath);
+    // ext4 metadata checksums (crc32c of group descriptors, inodes and extent tree
+    // blocks, or crc16 of gdt_csum descriptors) are checked and whatever doesn't match
+    // is skipped with the files depending on it. A bad superblock fails the Parse.
+    // Off by default. NTFS records are always checked by their update sequence, a bad one
+    // is skipped and counted.
+    void set_verify_checksums(bool verify);
+    ChecksumReport checksums() const;
+    // scheduled metadata reads kept in flight by this many background threads while the
+    // parser decodes what has arrived, 0 to read in the parser's thread. 2 by default.
+    // Disks without concurrent_reads are always read in the parser's thread.
+    void set_read_depth(int depth);
     FSParser(std::shared_ptr<Disk> disk);
-    FSParser(){filesystem_ = nullptr;}
+    FSParser();
     virtual ~FSParser();
 
 protected:
+    // independent pieces of a scan (ext block groups, NTFS bitmap chunks) for sampling and checkpoints
+    virtual uint64_t unit_count() { return 0; }
+    virtual uint64_t unit_bytes() { return 0; }
+    // sets filter_ and [first, end) to the units holding its files, empty if there are none
+    virtual void begin_scan(const ScanFilter&, uint64_t& first, uint64_t& end) { first = end = 0; }
+    // units of a begun scan, batched as a whole Parse does them
+    virtual void parse_units(BlockFunc&, MetadataFunc&, uint64_t, uint64_t) {}
+    virtual uint64_t buffer_bytes() { return 0; }
+    virtual bool lookup_file(uint64_t, BlockFunc&, MetadataFunc&) { return false; }
+    void record_peak_rss();
+    bool count_checksum(bool valid) {
+        checksum_report_.checked++;
+        checksum_report_.failed += !valid;
+        return valid;
+    }
+
+    // disk_->read accounted to its call site, served from sched_ if it has the data
+    void read(ScanStats::ReadSite site, void* buffer, size_t size, uint64_t offset);
+    // reads everything added to sched_ in disk order
+    void issue_reads();
+
     std::shared_ptr<Disk> disk_;
+    ScanFilter filter_;
+    ScanStats stats_;
+    std::unique_ptr<ReadScheduler> sched_;
+    std::unique_ptr<ReadPipeline> pipeline_; // null if reads are done in place
+    std::unique_ptr<PathIndex> paths_; // only while a Parse emitting paths runs
+    PathFunc print_path_;
+    uint64_t memory_budget_;
+    uint64_t peak_rss_;
+    bool verify_checksums_;
+    ChecksumReport checksum_report_;
 
 private:
+    // the path index, timer and peak RSS around a Parse of filesystem_
+    void run_scan(const std::function<void()>& scan);
+
     FSParser* filesystem_;
 };
 
+// callbacks for one image of a batch, called on the pool thread scanning it
+struct ScanSinks {
+    BlockFunc block;
+    MetadataFunc metadata;
+};
+
+struct BatchOptions {
+    BatchOptions() : threads(0), per_device(2), memory_budget(0) {}
+
+    unsigned threads;    // pool size, 0 for one thread per core
+    unsigned per_device; // images scanned at once from one device
+    uint64_t memory_budget; // shared by the running scans, 0 if not limited
+    ThrottleOptions throttle; // of each device, shared by its scans
+};
+
+struct BatchResult {
+    std::string name;
+    std::string error; // empty if the scan succeeded
+    uint64_t files;
+    uint64_t extents;
+    uint64_t bytes_read; // metadata read from the image
+    double seconds;
+};
+
+struct BatchReport {
+    std::vector<BatchResult> images; // in the order they were added
+    uint64_t files;
+    uint64_t extents;
+    uint64_t bytes_read;
+    double seconds; // wall time of the whole batch
+    uint64_t peak_rss;
+};
+
+// Scans many images on one thread pool. Images of one device share its
+// concurrency limit and devices take turns, so the batch is bound by cores
+// and devices rather than by the number of images.
+class BatchScanner {
+public:
+    BatchScanner(const BatchOptions& options = BatchOptions());
+    // device defaults to the one holding the image file, the image is opened when its scan starts
+    void add(const std::string& image_path, const std::string& device = "");
+    void add(const std::string& name, std::shared_ptr<Disk> disk, const std::string& device);
+    // every partition with a known filesystem as its own scan named image_path:pN, with
+    // file ids prefixed by pN/; the whole image if it isn't partitioned. Returns scans added.
+    size_t add_partitions(const std::string& image_path, const std::string& device = "");
+    // prefix of the file ids from the i-th added image, like pN/, empty if it has none
+    const std::string& tag(size_t image) const;
+    // sinks(i) gives the callbacks for the i-th added image on the thread scanning it,
+    // empty ones are skipped
+    BatchReport Run(const std::function<ScanSinks(size_t)>& sinks);
+
+private:
+    struct Job {
+        std::string name;
+        std::string path; // opened by the scan if disk is null
+        std::shared_ptr<Disk> disk;
+        std::string device;
+        std::string tag; // file id prefix
+        uint64_t offset; // window of the disk to scan, whole disk if size is 0
+        uint64_t size;
+    };
+
+    void scan(const Job& job, const ScanSinks& sinks, const std::shared_ptr<Throttle>& throttle,
+              BatchResult& result);
+
+    BatchOptions options_;
+    std::vector<Job> jobs_;
+    uint64_t memory_budget_; // of one scan
+};
+
+// Extents of a scan kept compressed in memory for queries. Files are sorted by id
+// and varint encoded in blocks of 64, each extent as the difference to the end of
+// the one before it. Numeric ids (or their numeric prefix) are stored as numbers.
+class ExtentStore {
+public:
+    ExtentStore();
+    // in any order, extents of a file may come in several pieces like NTFS extension records give them
+    void add(const std::string& file_id, uint64_t file_size, uint64_t offset, uint64_t phys_offset, uint64_t length);
+    // encodes what was added, call before the queries
+    void finish();
+
+    // all extents, files in id order
+    void ForEach(BlockFunc& printBlock) const;
+    // extents of the file overlapping [offset, offset + length), false if there's no such file
+    bool Find(const std::string& file_id, BlockFunc& printBlock, uint64_t offset = 0, uint64_t length = UINT64_MAX) const;
+    // extents overlapping physical blocks [phys_offset, phys_offset + length)
+    void FindRange(uint64_t phys_offset, uint64_t length, BlockFunc& printBlock) const;
+
+    uint64_t file_count() const {
+        return file_count_;
+    }
+    uint64_t extent_count() const {
+        return extent_count_;
+    }
+    size_t memory_bytes() const;
+
+private:
+    struct Block {
+        uint64_t first_number;
+        uint32_t first_tail;
+        uint32_t files;
+        size_t offset; // in data_
+        uint64_t phys_first; // range of the block's extents
+        uint64_t phys_last;
+    };
+
+    struct Extent {
+        uint64_t offset;
+        uint64_t phys_offset;
+        uint64_t length;
+    };
+
+    struct File {
+        uint64_t number; // numeric prefix of the id + 1, 0 if there's none
+        uint32_t tail;
+        uint64_t size;
+        std::vector<Extent> extents;
+    };
+
+    struct Context;
+
+    uint32_t intern_tail(const std::string& tail_id);
+    std::string join_id(uint64_t number, uint32_t tail) const;
+    int compare_id(uint64_t number, uint32_t tail, uint64_t other_number, uint32_t other_tail) const;
+    void add_piece();
+    void encode_file(std::vector<uint8_t>& out, Context& context, const File& file, int size_shift);
+    const uint8_t* decode_file(const uint8_t* in, Context& context, File& file, int size_shift) const;
+    template <class FileFunc>
+    void for_each_file(size_t first_block, size_t last_block, FileFunc func) const;
+
+    std::vector<uint8_t> pieces_; // added pieces, each encoded on its own
+    std::vector<size_t> piece_offsets_;
+    std::vector<uint8_t> data_;
+    std::vector<Block> blocks_;
+    std::vector<std::string> tails_; // non-numeric parts of the ids
+    std::unordered_map<std::string, uint32_t> tail_index_;
+    int size_shift_;
+    std::string current_id_;
+    File current_; // piece being added
+    uint64_t file_count_;
+    uint64_t extent_count_;
+};
+
+// One difference between the extents of two snapshots of a volume. Offsets and
+// lengths are in fs blocks (ext) or clusters (NTFS), as in BlockFunc.
+struct ExtentChange {
+    enum Kind {
+        FILE_ADDED,      // only in the new snapshot, its ranges aren't reported
+        FILE_REMOVED,    // only in the old snapshot
+        FILE_RESIZED,
+        RANGE_ADDED,     // [offset, offset + length) of the file is mapped only in the new snapshot
+        RANGE_REMOVED,   // ... only in the old snapshot
+        RANGE_RELOCATED  // mapped at old_phys_offset before and at new_phys_offset now
+    };
+
+    Kind kind;
+    std::string file_id;
+    uint64_t old_size;
+    uint64_t new_size;
+    uint64_t offset;
+    uint64_t length;
+    uint64_t old_phys_offset;
+    uint64_t new_phys_offset;
+};
+
+using ChangeFunc = std::function<void(const ExtentChange&)>;
+
+struct DiffOptions {
+    DiffOptions() : temp_dir("/tmp"), memory_limit(64 << 20) {}
+
+    std::string temp_dir; // for the extent maps of scanned images
+    size_t memory_limit;  // extents sorted in memory at once, more are sorted in runs on disk
+};
+
+// Compares two snapshots of a volume by their extents. Each side is scanned into
+// an extent map sorted by file id and offset, or taken from a map saved earlier,
+// and the maps are merge-joined so only one file of each is in memory at a time.
+// Changes come sorted by file id, adjacent ranges of one kind are reported as one.
+class SnapshotDiff {
+public:
+    SnapshotDiff(const DiffOptions& options = DiffOptions());
+    // scans disk into an extent map file to diff against later
+    void SaveMap(std::shared_ptr<Disk> disk, const std::string& map_path);
+    void Diff(std::shared_ptr<Disk> old_disk, std::shared_ptr<Disk> new_disk, const ChangeFunc& printChange);
+    void Diff(const std::string& old_map_path, std::shared_ptr<Disk> new_disk, const ChangeFunc& printChange);
+    void Diff(const std::string& old_map_path, const std::string& new_map_path, const ChangeFunc& printChange);
+
+private:
+    std::string temp_path();
+
+    DiffOptions options_;
+};
+
 #endif	/* FS_STAT_H */
 
@@ -107,6 +107,22 @@ struct __attribute__((__packed__)) NTFSStdInfo {
     uint32_t flags;
 };
 
+struct __attribute__((__packed__)) NTFSFileName {
+    uint64_t parent_fr : 48;
+    uint16_t parent_seq_number;
+    int64_t ctime;
+    int64_t mtime;
+    int64_t mft_mtime;
+    int64_t atime;
+    uint64_t allocated_size;
+    uint64_t real_size;
+    uint32_t flags;
+    uint32_t reparse_value;
+    uint8_t name_len; // in UTF-16 characters
+    uint8_t name_space; // 0 POSIX, 1 Win32, 2 DOS, 3 Win32 and DOS
+    char16_t name[0];
+};
+
 struct __attribute__((__packed__)) ExtSuperBlock {
     uint32_t s_inodes_count; /* Inodes count */
     uint32_t s_blocks_count_lo; /* Blocks count */
@@ -205,7 +221,12 @@ struct __attribute__((__packed__)) ExtSuperBlock {
     uint32_t s_grp_quota_inum; /* inode for tracking group quota */
     uint32_t s_overhead_clusters; /* overhead blocks/clusters in fs */
     uint32_t s_backup_bgs[2]; /* groups with sparse_super2 SBs */
-    uint32_t s_reserved[106]; /* Padding to the end of the block */
+    uint8_t s_encrypt_algos[4]; /* Encryption algorithms in use  */
+    uint8_t s_encrypt_pw_salt[16]; /* Salt used for string2key algorithm */
+    uint32_t s_lpf_ino; /* Location of the lost+found inode */
+    uint32_t s_prj_quota_inum; /* inode for tracking project quota */
+    uint32_t s_checksum_seed; /* crc32c(uuid) if csum_seed set */
+    uint32_t s_reserved[98]; /* Padding to the end of the block */
     uint32_t s_checksum; /* crc32c(superblock) */
 };
 
@@ -325,5 +346,54 @@ struct __attribute__((__packed__)) ExtExtentIndex {
     uint16_t ei_unused;
 };
 
+struct __attribute__((__packed__)) ExtDirEntry {
+    uint32_t inode;
+    uint16_t rec_len;
+    uint8_t name_len;
+    uint8_t file_type;
+    char name[0];
+};
+
+struct __attribute__((__packed__)) MBRPartitionEntry {
+    uint8_t status;
+    uint8_t chs_first[3];
+    uint8_t type;
+    uint8_t chs_last[3];
+    uint32_t first_lba;
+    uint32_t sector_count;
+};
+
+struct __attribute__((__packed__)) MBR {
+    char bootstrap[446];
+    MBRPartitionEntry partitions[4];
+    uint16_t signature;
+};
+
+struct __attribute__((__packed__)) GPTHeader {
+    char signature[8]; // "EFI PART"
+    uint32_t revision;
+    uint32_t header_size;
+    uint32_t header_crc32;
+    uint32_t reserved;
+    uint64_t current_lba;
+    uint64_t backup_lba;
+    uint64_t first_usable_lba;
+    uint64_t last_usable_lba;
+    uint8_t disk_guid[16];
+    uint64_t entries_lba;
+    uint32_t entry_count;
+    uint32_t entry_size;
+    uint32_t entries_crc32;
+};
+
+struct __attribute__((__packed__)) GPTEntry {
+    uint8_t type_guid[16];
+    uint8_t partition_guid[16];
+    uint64_t first_lba;
+    uint64_t last_lba;
+    uint64_t attributes;
+    uint16_t name[36];
+};
+
 #endif	/* FS_STRUCTS_H */
 
@@ -0,0 +1,240 @@
+#!/usr/bin/env python3
+# Generates a synthetic NTFS image for benchmarks: boot sector, a fragmented
+# $MFT with its $BITMAP, directories and files with fragmented $DATA runs,
+# named streams and attribute lists spread over extension records.
+# Only metadata is written, file data clusters stay sparse in the image.
+
+import argparse
+import random
+import struct
+
+SECTOR_SIZE = 512
+SECTORS_PER_CLUSTER = 8
+CLUSTER_SIZE = SECTOR_SIZE * SECTORS_PER_CLUSTER
+RECORD_SIZE = 1024
+MFT_RUNS = 3
+FIRST_USER_RECORD = 24
+
+
+def runlist(runs):
+    result = bytearray()
+    prev_lcn = 0
+    for lcn, length in runs:
+        length_bytes = length.to_bytes(8, 'little').rstrip(b'\0') or b'\0'
+        if lcn is None:
+            # sparse run
+            result += bytes([len(length_bytes)]) + length_bytes
+            continue
+        delta = (lcn - prev_lcn).to_bytes(8, 'little', signed=True)
+        prev_lcn = lcn
+        size = 8
+        while size > 1 and ((delta[size - 1] == 0 and delta[size - 2] < 0x80) or
+                            (delta[size - 1] == 0xff and delta[size - 2] >= 0x80)):
+            size -= 1
+        result += bytes([(size << 4) | len(length_bytes)]) + length_bytes + delta[:size]
+    return result + b'\0'
+
+
+def pad8(data):
+    return data + b'\0' * (-len(data) % 8)
+
+
+def resident_attr(type_id, attr_id, content, name=''):
+    name16 = name.encode('utf-16-le')
+    content_offset = (24 + len(name16) + 7) // 8 * 8
+    attr = pad8(bytearray(content_offset) + content)
+    struct.pack_into('<IIBBHHHIHBB', attr, 0, type_id, len(attr), 0, len(name), 24 if name else 0,
+                     0, attr_id, len(content), content_offset, 0, 0)
+    attr[24:24 + len(name16)] = name16
+    return bytes(attr)
+
+
+def nonresident_attr(type_id, attr_id, runs, size, name='', start_vcn=0):
+    name16 = name.encode('utf-16-le')
+    runlist_offset = (64 + len(name16) + 7) // 8 * 8
+    attr = pad8(bytearray(runlist_offset) + runlist(runs))
+    clusters = sum(length for _, length in runs)
+    struct.pack_into('<IIBBHHHQQHHIQQQ', attr, 0, type_id, len(attr), 1, len(name), 64 if name else 0,
+                     0, attr_id, start_vcn, start_vcn + clusters - 1, runlist_offset, 0, 0,
+                     clusters * CLUSTER_SIZE, size, size)
+    attr[64:64 + len(name16)] = name16
+    return bytes(attr)
+
+
+def std_info(time):
+    return struct.pack('<qqqqIIIIIIQQ', time, time + 1, time + 2, time + 3, 0x20, 0, 0, 0, 0, 0, 0, 0)
+
+
+def file_name(parent, name, size, directory=False):
+    name16 = name.encode('utf-16-le')
+    return struct.pack('<QqqqqQQIIBB', parent | (1 << 48), 1, 2, 3, 4, size, size,
+                       0x10000000 if directory else 0x20, 0, len(name), 1) + name16
+
+
+def attr_list_entry(type_id, start_vcn, record, attr_id):
+    entry = bytearray(32)
+    struct.pack_into('<IHBBQQH', entry, 0, type_id, 32, 0, 26, start_vcn, record | (1 << 48), attr_id)
+    return bytes(entry)
+
+
+def mft_record(number, attrs, base=0, flags=1):
+    record = bytearray(RECORD_SIZE)
+    struct.pack_into('<4sHHQHHHHIIQH', record, 0, b'FILE', 48, RECORD_SIZE // SECTOR_SIZE + 1, 0, 1, 1, 56,
+                     flags, 0, RECORD_SIZE, base | ((1 << 48) if base else 0), 0)
+    offset = 56
+    for attr in attrs:
+        record[offset:offset + len(attr)] = attr
+        offset += len(attr)
+    if offset + 8 > RECORD_SIZE:
+        raise ValueError('record %d overflows' % number)
+    record[offset:offset + 4] = b'\xff\xff\xff\xff'
+    struct.pack_into('<I', record, 24, offset + 8)
+
+    # update sequence array
+    usn = 1 + number % 0xfffe
+    struct.pack_into('<H', record, 48, usn)
+    for sector in range(RECORD_SIZE // SECTOR_SIZE):
+        tail = (sector + 1) * SECTOR_SIZE - 2
+        record[50 + 2 * sector:52 + 2 * sector] = record[tail:tail + 2]
+        struct.pack_into('<H', record, tail, usn)
+    return bytes(record)
+
+
+class Image:
+    def __init__(self, path, records):
+        self.out = open(path, 'wb')
+        self.records = records
+        self.run_records = (records + MFT_RUNS - 1) // MFT_RUNS
+        self.run_clusters = self.run_records * RECORD_SIZE // CLUSTER_SIZE
+        self.mft_runs = [(16, self.run_clusters)]
+        self.cursor = 16 + self.run_clusters + 8
+        self.used = []
+
+    def alloc(self, clusters, gap=0):
+        self.cursor += gap
+        start = self.cursor
+        self.cursor += clusters
+        return start
+
+    def write(self, offset, data):
+        self.out.seek(offset)
+        self.out.write(data)
+
+    def write_record(self, number, attrs, base=0, flags=1):
+        run = number // self.run_records
+        while len(self.mft_runs) <= run:
+            # later $MFT runs are placed among the file data, like a grown MFT
+            self.mft_runs.append((self.alloc(self.run_clusters, 5), self.run_clusters))
+        lcn = self.mft_runs[run][0]
+        self.write(lcn * CLUSTER_SIZE + (number % self.run_records) * RECORD_SIZE,
+                   mft_record(number, attrs, base, flags))
+        self.used.append(number)
+
+    def finish(self):
+        while len(self.mft_runs) < MFT_RUNS:
+            self.mft_runs.append((self.alloc(self.run_clusters, 5), self.run_clusters))
+        bitmap = bytearray(self.records // 8)
+        for number in self.used + [0]:
+            bitmap[number // 8] |= 1 << (number % 8)
+        bitmap_clusters = (len(bitmap) + CLUSTER_SIZE - 1) // CLUSTER_SIZE
+        bitmap_lcn = self.alloc(bitmap_clusters, 2)
+        self.write(bitmap_lcn * CLUSTER_SIZE, bytes(bitmap))
+
+        mft_size = self.records * RECORD_SIZE
+        self.write_record(0, [resident_attr(16, 0, std_info(1000)),
+                              resident_attr(48, 3, file_name(5, '$MFT', mft_size)),
+                              nonresident_attr(128, 1, self.mft_runs, mft_size),
+                              nonresident_attr(176, 5, [(bitmap_lcn, bitmap_clusters)], len(bitmap))])
+
+        total_clusters = max(16384, self.cursor + 64)
+        boot = bytearray(SECTOR_SIZE)
+        struct.pack_into('<3s8sHBH5sB18sQQQb3sb3sQ', boot, 0, b'\xebR\x90', b'NTFS    ', SECTOR_SIZE,
+                         SECTORS_PER_CLUSTER, 0, b'\0' * 5, 0xf8, b'\0' * 18,
+                         total_clusters * SECTORS_PER_CLUSTER - 1, 16, self.mft_runs[-1][0],
+                         -10, b'\0' * 3, 1, b'\0' * 3, 0x1234)
+        boot[510:512] = b'\x55\xaa'
+        self.write(0, bytes(boot))
+        self.out.truncate(total_clusters * CLUSTER_SIZE)
+        self.out.close()
+
+
+def generate(args):
+    rnd = random.Random(args.seed)
+    dir_count = args.files // 1000 + 1
+    # files with attribute lists take two extension records, leave room for the random spread
+    records = FIRST_USER_RECORD + dir_count + args.files + 3 * int(args.files * args.attr_list_share) + 64
+    records = (records + 8 * MFT_RUNS - 1) // (8 * MFT_RUNS) * (8 * MFT_RUNS)
+    image = Image(args.image, records)
+
+    image.write_record(5, [resident_attr(16, 0, std_info(500)),
+                           resident_attr(48, 1, file_name(5, '.', 0, True)),
+                           resident_attr(144, 2, b'\0' * 32, '$I30')], flags=3)
+    next_record = FIRST_USER_RECORD
+    dirs = [5]
+    for i in range(dir_count):
+        image.write_record(next_record, [resident_attr(16, 0, std_info(600 + i)),
+                                         resident_attr(48, 1, file_name(rnd.choice(dirs), 'dir%d' % i, 0, True)),
+                                         resident_attr(144, 2, b'\0' * 32, '$I30')], flags=3)
+        dirs.append(next_record)
+        next_record += 1
+
+    for i in range(args.files):
+        number = next_record
+        next_record += 1
+        parent = rnd.choice(dirs)
+        name = 'file%d_%s.dat' % (i, 'é' if i % 3 == 0 else 'x')
+        base_attrs = [resident_attr(16, 0, std_info(2000 + i))]
+
+        if rnd.random() < args.resident_share:
+            data = b'resident' * 8
+            image.write_record(number, base_attrs + [resident_attr(48, 1, file_name(parent, name, len(data))),
+                                                     resident_attr(128, 2, data)])
+            continue
+
+        run_count = rnd.randint(1, 2 * args.runs_per_file - 1)
+        runs = []
+        for k in range(run_count):
+            length = rnd.randint(1, 6)
+            if k > 0 and rnd.random() < args.sparse_share:
+                runs.append((None, length))
+            else:
+                runs.append((image.alloc(length, rnd.randrange(3)), length))
+        size = sum(length for _, length in runs) * CLUSTER_SIZE - rnd.randrange(CLUSTER_SIZE)
+        fname = resident_attr(48, 1, file_name(parent, name, size))
+
+        if run_count >= 2 and rnd.random() < args.attr_list_share:
+            # $DATA split in two halves, each in its own extension record
+            first, second = next_record, next_record + 1
+            next_record += 2
+            half = run_count // 2
+            second_vcn = sum(length for _, length in runs[:half])
+            attr_list = (attr_list_entry(16, 0, number, 0) + attr_list_entry(48, 0, number, 1) +
+                         attr_list_entry(128, 0, first, 0) + attr_list_entry(128, second_vcn, second, 0))
+            list_lcn = image.alloc(1, 1)
+            image.write(list_lcn * CLUSTER_SIZE, attr_list)
+            image.write_record(number, base_attrs + [nonresident_attr(32, 4, [(list_lcn, 1)], len(attr_list)),
+                                                     fname])
+            image.write_record(first, [nonresident_attr(128, 0, runs[:half], size)], base=number)
+            image.write_record(second, [nonresident_attr(128, 0, runs[half:], 0, start_vcn=second_vcn)],
+                               base=number)
+            continue
+
+        attrs = base_attrs + [fname, nonresident_attr(128, 2, runs, size)]
+        if rnd.random() < args.stream_share:
+            attrs.append(nonresident_attr(128, 3, [(image.alloc(2, 1), 2)], 7000, name='stream'))
+        image.write_record(number, attrs)
+
+    image.finish()
+
+
+if __name__ == '__main__':
+    parser = argparse.ArgumentParser()
+    parser.add_argument('image')
+    parser.add_argument('--files', type=int, default=10000)
+    parser.add_argument('--runs-per-file', type=int, default=3, help='average number of data runs')
+    parser.add_argument('--attr-list-share', type=float, default=0.1)
+    parser.add_argument('--resident-share', type=float, default=0.1)
+    parser.add_argument('--stream-share', type=float, default=0.1)
+    parser.add_argument('--sparse-share', type=float, default=0.0)
+    parser.add_argument('--seed', type=int, default=1)
+    generate(parser.parse_args())
@@ -6,10 +6,14 @@
 
 #include <chrono>
 #include <ctime>
+#include <fcntl.h>
 #include <iostream>
+#include <mutex>
+#include <sys/stat.h>
+#include <unistd.h>
 
 void PrintBlock(std::shared_ptr<typename std::ofstream>  output, std::string fileId, uint64_t file_size,
-        uint32_t start_offset, uint32_t start_phys_offset, int32_t len) {
+        uint64_t start_offset, uint64_t start_phys_offset, uint64_t len) {
     *output << fileId << "," << file_size << "," << start_offset << ","
                     << start_phys_offset << "," << len << std::endl;
 }
@@ -21,22 +25,37 @@ void PrintMetadata(std::shared_ptr<typename std::ofstream>  meta_output,
             << encrypted << "," << ctime << "," << mtime << "," << atime << std::endl;
 }
 
-float Test(std::string file_path) {
+// makes a flushed output durable, returns its size
+uint64_t SyncFile(const char* path) {
+    struct stat st;
+    int fd = open(path, O_RDONLY);
+    if (fd < 0 || fsync(fd) || fstat(fd, &st)) {
+        throw std::runtime_error("ERROR WITH FILES");
+    }
+    close(fd);
+    return st.st_size;
+}
+
+float Test(std::string file_path, std::string checkpoint_path) {
     std::shared_ptr<std::ofstream> output(new std::ofstream),
             meta_output(new std::ofstream);
 
-    output->open("./out.txt");
-    meta_output->open("./meta_out.txt");
+    // a resumed scan appends to the outputs after rewinding them to the checkpoint
+    std::ios::openmode mode = std::ofstream::out;
+    if (!checkpoint_path.empty() && std::ifstream(checkpoint_path).good()) {
+        mode |= std::ofstream::app;
+    }
+    output->open("./out.txt", mode);
+    meta_output->open("./meta_out.txt", mode);
 
     if (!output->is_open() || !meta_output->is_open()) {
         throw std::runtime_error("ERROR WITH FILES");
     }
 
-    std::shared_ptr<Disk> disk(new DiskOverRegFile(file_path));
-    FSParser file_sys(disk);
+    std::shared_ptr<Disk> disk = OpenDisk(file_path);
 
     std::function<void(std::string, uint64_t,
-        uint32_t, uint32_t, int32_t)> printBlck = std::bind(PrintBlock, output,
+        uint64_t, uint64_t, uint64_t)> printBlck = std::bind(PrintBlock, output,
             std::placeholders::_1, std::placeholders::_2, std::placeholders::_3,
             std::placeholders::_4, std::placeholders::_5);
 
@@ -48,7 +67,52 @@ float Test(std::string file_path) {
 
     std::chrono::time_point<std::chrono::system_clock> timerStart, timerEnd;
     timerStart = std::chrono::system_clock::now();
-    file_sys.Parse(printBlck, printMeta);
+    if (FSParser::Detect(disk) != FS_UNKNOWN && !checkpoint_path.empty()) {
+        CheckpointOptions checkpoint;
+        checkpoint.path = checkpoint_path;
+        checkpoint.sync_outputs = [&output, &meta_output]() {
+            output->flush();
+            meta_output->flush();
+            return std::vector<uint64_t>{SyncFile("./out.txt"), SyncFile("./meta_out.txt")};
+        };
+        checkpoint.rewind_outputs = [](const std::vector<uint64_t>& offsets) {
+            if (offsets.size() != 2 || truncate("./out.txt", offsets[0]) || truncate("./meta_out.txt", offsets[1])) {
+                throw std::runtime_error("ERROR WITH FILES");
+            }
+        };
+        FSParser file_sys(disk);
+        file_sys.Parse(printBlck, printMeta, ScanFilter(), checkpoint);
+    } else if (FSParser::Detect(disk) != FS_UNKNOWN) {
+        FSParser file_sys(disk);
+        file_sys.Parse(printBlck, printMeta);
+    } else {
+        // whole-disk image, the partitions are scanned in parallel into the same outputs,
+        // metadata rows get the same pN/ prefix as the file ids
+        std::mutex output_mutex;
+        BatchScanner scanner;
+        scanner.add_partitions(file_path);
+        BatchReport report = scanner.Run([&](size_t image) {
+            std::string tag = scanner.tag(image);
+            ScanSinks sinks;
+            sinks.block = [&](std::string fileId, uint64_t file_size,
+                    uint64_t start_offset, uint64_t start_phys_offset, uint64_t len) {
+                std::lock_guard<std::mutex> lock(output_mutex);
+                printBlck(fileId, file_size, start_offset, start_phys_offset, len);
+            };
+            sinks.metadata = [&, tag](uint32_t inode_num, uint64_t file_size,
+                    bool compressed, bool encrypted, int64_t ctime, int64_t mtime, int64_t atime) {
+                std::lock_guard<std::mutex> lock(output_mutex);
+                *meta_output << tag;
+                printMeta(inode_num, file_size, compressed, encrypted, ctime, mtime, atime);
+            };
+            return sinks;
+        });
+        for (const BatchResult& result : report.images) {
+            if (!result.error.empty()) {
+                std::cerr << result.name << ": " << result.error << std::endl;
+            }
+        }
+    }
     timerEnd = std::chrono::system_clock::now();
     float elapsed_seconds = ((float) std::chrono::duration_cast<std::chrono::microseconds>
                              (timerEnd-timerStart).count()) / 1000000;
@@ -58,19 +122,13 @@ float Test(std::string file_path) {
 }
 
 int main(int argc, char** argv) {
-    std::string file_path;
-
-    // sudo sh -c 'sync; echo 3 > /proc/sys/vm/drop_caches'
-    for (int iter = 0; iter < 10; ++iter) {
-       // system("sudo sh -c 'sync; echo 3 > /proc/sys/vm/drop_caches'");
-        //std::cout << Test("/media/alex/DATA/Work/fs_stat/fs_images/big_ext") << std::endl;
-        //std::cout << Test("/media/alex/DATA/Work/fs_stat/fs_images/small_ext4") << std::endl;
-        std::cout << Test("/mnt/hgfs/fs_stat/fs_images/flash_img.img") << std::endl;
-        //std::cout << Test("/media/alex/DATA/Work/fs_stat/fs_images/small_ext3") << std::endl;
+    if (argc != 2 && argc != 3) {
+        std::cerr << "usage: " << argv[0] << " image [checkpoint]" << std::endl;
+        return 1;
     }
 
-    std::cout.flush();
+    // see fs_bench for cold/warm cache throughput
+    std::cout << Test(argv[1], argc == 3 ? argv[2] : "") << std::endl;
 
     return 0;
 }
-
@@ -0,0 +1,92 @@
+#!/bin/bash
+# Builds reproducible benchmark images: usage make_bench_images.sh DIR SCALE...
+# For every scale (number of files) makes ext2 (block maps), ext4 (extents)
+# and NTFS (gen_ntfs_image.py) images. FRAG_SHARE of the ext files are written
+# into punched free space and come out fragmented.
+
+set -e
+
+OUT_DIR=${1:?usage: $0 DIR SCALE...}
+shift
+SCALES=${@:-10000}
+FRAG_SHARE=${FRAG_SHARE:-0.2}
+FILES_PER_DIR=1000
+SRC_DIR=$(cd "$(dirname "$0")" && pwd)
+# percent of files:size in 4K blocks, direct blocks only, single and double indirect for block maps
+TEMPLATES="50:1 30:3 15:12 4:40 1:1100"
+
+mkdir -p "$OUT_DIR/templates"
+blocks_per_100=0
+for t in $TEMPLATES; do
+    head -c $((${t#*:} * 4096)) /dev/urandom > "$OUT_DIR/templates/t${t#*:}"
+    blocks_per_100=$((blocks_per_100 + ${t%%:*} * ${t#*:}))
+done
+
+debugfs_script() {
+    # populates FILES files, FRAG_SHARE of them written into every other free block
+    awk -v files="$1" -v frag="$FRAG_SHARE" -v per_dir=$FILES_PER_DIR -v tmpl="$OUT_DIR/templates" \
+            -v templates="$TEMPLATES" '
+    function template(i,    r, k, share) {
+        r = (i * 2654435761) % 100
+        for (k = 1; k <= count; k++) {
+            share += percent[k]
+            if (r < share) break
+        }
+        return tmpl "/t" size[k]
+    }
+    BEGIN {
+        count = split(templates, entries, " ")
+        for (k = 1; k <= count; k++) {
+            split(entries[k], fields, ":")
+            percent[k] = fields[1]
+            size[k] = fields[2]
+        }
+        fragmented = int(files * frag)
+        holes = fragmented * 10
+        print "mkdir fill"
+        for (i = 0; i < holes; i++) print "write " tmpl "/t1 fill/" i
+        for (i = 0; i < holes; i += 2) print "rm fill/" i
+        for (i = 0; i < files; i++) {
+            if (i % per_dir == 0) {
+                dir = "/d" int(i / per_dir)
+                print "cd /"
+                print "mkdir " dir
+                print "cd " dir
+            }
+            print "write " template(i) " f" i
+            if (i + 1 == fragmented) {
+                for (j = 1; j < holes; j += 2) print "rm /fill/" j
+            }
+        }
+    }'
+}
+
+for files in $SCALES; do
+    holes=$(($(awk -v files=$files -v frag="$FRAG_SHARE" 'BEGIN { print int(files * frag) }') * 10))
+    dirs=$(((files + FILES_PER_DIR - 1) / FILES_PER_DIR))
+    inodes=$((files + holes + dirs + 4096))
+    # the files and the fill at its peak, a third more for indirect blocks and
+    # directories, then the inode tables and the journal
+    blocks=$((files * blocks_per_100 / 100 + holes))
+    size_mb=$((blocks * 4 / 1024 * 4 / 3 + inodes * 256 / 1048576 + 256))
+    for type in ext2 ext4; do
+        image="$OUT_DIR/${type}_$files.img"
+        rm -f "$image"
+        truncate -s ${size_mb}M "$image"
+        mke2fs -q -F -t $type -b 4096 -N $inodes "$image"
+        # debugfs carries on past a failed command and only reports it on stderr
+        debugfs_script $files | debugfs -w -f - "$image" 2> "$image.log" > /dev/null
+        errors=$(grep -v '^debugfs [0-9]' "$image.log" | head -5)
+        if [ -n "$errors" ]; then
+            echo "$errors" >&2
+            echo "$image: debugfs failed, see $image.log" >&2
+            exit 1
+        fi
+        rm -f "$image.log"
+        echo "$image"
+    done
+
+    image="$OUT_DIR/ntfs_$files.img"
+    python3 "$SRC_DIR/gen_ntfs_image.py" "$image" --files $files --seed 1
+    echo "$image"
+done
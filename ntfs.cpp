@@ -1,22 +1,85 @@
 #include "FS.h"
 
 #include <iostream>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
 enum {
     ATTR_COMPRESSED = 1,
     ATTR_ENCRYPTED = 0x4000,
-    ATTR_SPARSE = 0x8000
+    ATTR_SPARSE = 0x8000,
+
+    BITMAP_CHUNK_SIZE = 512,
+    SCHED_WINDOW = 256, // records whose reads are issued together
+    FIXUP_STRIDE = 512 // the update sequence covers 512 byte pieces whatever the sector size
 };
 
 inline uint64_t MIN(uint64_t x, uint64_t y){
     return x < y ? x : y;
 }
 
+inline NTFSAttribute* attr_shift(NTFSAttribute* &attr, size_t value) {
+    return attr = (NTFSAttribute*) (((char*) attr) + value);
+}
+
+// calls func(vcn, lcn, length, sparse) for every run of a runlist starting at vcn,
+// lcn means nothing for a sparse run
+template <class RunFunc>
+void walk_runlist(const NTFSRunlistEntry* run_format, uint64_t vcn, RunFunc func) {
+    int64_t lcn = 0;
+    while (*(const char*) run_format) {
+        if (run_format->runlen_length > 8 || run_format->offset_length > 8) {
+            throw std::runtime_error("bad runlist entry");
+        }
+        uint64_t run_length = 0;
+        int64_t run_offset = 0;
+        memcpy(&run_length, run_format + 1, run_format->runlen_length);
+        if (run_format->offset_length) {
+            int shift = 64 - 8 * run_format->offset_length;
+            memcpy(&run_offset, run_format + 1 + run_format->runlen_length, run_format->offset_length);
+            lcn += (int64_t) ((uint64_t) run_offset << shift) >> shift;
+        }
+        func(vcn, (uint64_t) lcn, run_length, run_format->offset_length == 0);
+        vcn += run_length;
+        run_format = run_format + 1 + run_format->runlen_length + run_format->offset_length;
+    }
+}
+
+// calls func(vcn, lcn, length) for every allocated run of a nonresident attribute
+template <class RunFunc>
+void for_each_run(const NTFSNonresidentAttr* attr, RunFunc func) {
+    const NTFSRunlistEntry* run_format = (const NTFSRunlistEntry*) (((const char*) attr) + attr->runlist_offset);
+    walk_runlist(run_format, attr->start_vcn, [&func](uint64_t vcn, uint64_t lcn, uint64_t length, bool sparse) {
+        if (!sparse) {
+            func(vcn, lcn, length);
+        }
+    });
+}
+
+// sets the site reads through read_runlist are accounted to, until the end of the scope
+class ReadSiteScope {
+public:
+    ReadSiteScope(ScanStats::ReadSite& site, ScanStats::ReadSite value) : site_(site), saved_(site) {
+        site = value;
+    }
+    ~ReadSiteScope() {
+        site_ = saved_;
+    }
+
+private:
+    ScanStats::ReadSite& site_;
+    ScanStats::ReadSite saved_;
+};
+
 NTFS::NTFS(std::shared_ptr<Disk> disk) {
     disk_ = disk;
+    sched_.reset(new ReadScheduler());
+    set_read_depth(ReadPipeline::DEFAULT_DEPTH);
+    window_count_ = 0;
 
     std::unique_ptr<NTFSBootSector> boot(new NTFSBootSector);
-    disk_->read(boot.get(), sizeof(NTFSBootSector), 0);
+    read(ScanStats::READ_BOOT_SECTOR, boot.get(), sizeof(NTFSBootSector), 0);
 
     sector_size_ = boot->bytes_per_sector;
     sectors_per_cluster_ = boot->sectors_per_cluster;
@@ -35,40 +98,95 @@ NTFS::NTFS(std::shared_ptr<Disk> disk) {
     mft_fr_ = (NTFSMftEntry *) new char[fr_size_];
     tmp_fr_ = (NTFSMftEntry *) new char[fr_size_];
 
-    disk_->read(mft_fr_, fr_size_, mft_cluster_ * cluster_size_);
+    read(ScanStats::READ_MFT_RECORD, mft_fr_, fr_size_, mft_cluster_ * cluster_size_);
+    read_site_ = ScanStats::READ_MFT_RECORD;
 
-    fixup((char*) mft_fr_);
+    char mft_valid;
+    fixup_records((char*) mft_fr_, 1, &mft_valid);
+    if (!mft_valid) {
+        throw std::runtime_error("bad $MFT record");
+    }
+
+    // $MFT runs for scheduling record reads, if its $DATA is in the first record
+    NTFSAttribute* attr = (NTFSAttribute*) (((char*) mft_fr_) + mft_fr_->first_attr_offset);
+    for (; attr->type_id != 0xffffffff; attr_shift(attr, attr->attr_len)) {
+        if (attr->type_id == 128 && attr->nonresident_flag && attr->name_len == 0) {
+            for_each_run((NTFSNonresidentAttr*) attr, [this](uint64_t vcn, uint64_t lcn, uint64_t length) {
+                mft_runs_.push_back({vcn, lcn, length});
+            });
+            break;
+        }
+    }
 }
 
 NTFS::~NTFS() {
-    delete mft_fr_;
-    delete tmp_fr_;
+    delete[] (char*) mft_fr_;
+    delete[] (char*) tmp_fr_;
 }
 
-void NTFS::fixup(char* start) {
-    unsigned fixup_off = *((unsigned*) (start + 4)) % 0x10000; //offset to fixup value and array
-    unsigned fixup_count = *((unsigned*) (start + 6)) % 0x10000 - 1; //entries in fixup array
-    for (unsigned i = 0; i < fixup_count; ++i) {
-        if (start[(i + 1) * sector_size_ - 2] != start[fixup_off] ||
-                start[(i + 1) * sector_size_ - 1] != start[fixup_off + 1]) {
-            throw std::runtime_error("fixup mismatch");;
+// Checks the update sequence of count records lying one after another and puts the saved
+// piece tails back, a word at a time. A record whose header or tails don't match is left
+// as read with valid[i] = 0. Returns the number of those.
+size_t NTFS::fixup_records(char* records, size_t count, char* valid) {
+    SCAN_STAT_TIMER(fixup_ns);
+    size_t bad = 0;
+    for (size_t r = 0; r < count; r++) {
+        char* record = records + r * fr_size_;
+        uint16_t fixup_off, fixup_count; // offset to the sequence number and its array, entries in both
+        memcpy(&fixup_off, record + offsetof(NTFSMftEntry, fixup_offset), 2);
+        memcpy(&fixup_count, record + offsetof(NTFSMftEntry, fixup_count), 2);
+        size_t pieces = fixup_count - 1;
+        bool ok = fixup_count != 0 && pieces * FIXUP_STRIDE <= fr_size_ &&
+                fixup_off + 2 * (size_t) fixup_count <= fr_size_ && memcmp(record, "BAAD", 4);
+        if (ok) {
+            // the tails packed four to a 64-bit word, each word checked against the sequence number at once
+            uint16_t usn;
+            memcpy(&usn, record + fixup_off, 2);
+            uint64_t usns = usn * 0x0001000100010001ULL, mismatch = 0;
+            for (size_t i = 1; i <= pieces; i += 4) {
+                uint64_t tails = usns;
+                for (size_t k = 0; k < 4 && i + k <= pieces; k++) {
+                    uint16_t tail;
+                    memcpy(&tail, record + (i + k) * FIXUP_STRIDE - 2, 2);
+                    tails = (tails & ~(0xffffULL << 16 * k)) | (uint64_t) tail << 16 * k;
+                }
+                mismatch |= tails ^ usns;
+            }
+            ok = mismatch == 0;
         }
-        start[(i + 1) * sector_size_ - 2] = start[fixup_off + 2 + i * 2];
-        start[(i + 1) * sector_size_ - 1] = start[fixup_off + 3 + i * 2];
-    }
-    if (!memcmp(start, "BAAD", 4)) {
-       throw std::runtime_error("BAAD");
+        if (ok) {
+            for (size_t i = 1; i <= pieces; i++) {
+                memcpy(record + i * FIXUP_STRIDE - 2, record + fixup_off + 2 * i, 2);
+            }
+        }
+        valid[r] = ok;
+        bad += !ok;
     }
+    return bad;
 }
 
-size_t utf16_to_utf8(char16_t* const start16, char16_t* const end16,
+size_t utf16_to_utf8(const char16_t* const start16, const char16_t* const end16,
         char* const start8, char* const end8) {
 
-    char16_t* ptr16 = start16;
+    const char16_t* ptr16 = start16;
     char* ptr8 = start8;
     uint32_t chr;
     while (ptr16 < end16 && ptr8 < end8) {
-        if (((*ptr16) & 0xd800) == 0xd800) {
+#ifdef __SSE2__
+        // the ASCII prefix of the next 8 characters at once, the bytes past it are overwritten later
+        if (end16 - ptr16 >= 8 && end8 - ptr8 >= 8) {
+            __m128i chars = _mm_loadu_si128((const __m128i*) ptr16);
+            __m128i ascii = _mm_cmpeq_epi16(_mm_and_si128(chars, _mm_set1_epi16((short) 0xff80)), _mm_setzero_si128());
+            int ascii_count = __builtin_ctz(~_mm_movemask_epi8(ascii)) / 2;
+            _mm_storel_epi64((__m128i*) ptr8, _mm_packus_epi16(chars, chars));
+            ptr16 += ascii_count;
+            ptr8 += ascii_count;
+            if (ascii_count == 8) {
+                continue;
+            }
+        }
+#endif
+        if (((*ptr16) & 0xf800) == 0xd800) {
             if (ptr8 + 3 >= end8 || ptr16 + 1 >= end16) {
                 break;
             }
@@ -105,8 +223,37 @@ size_t utf16_to_utf8(char16_t* const start16, char16_t* const end16,
     return ptr8 - start8;
 }
 
-inline NTFSAttribute* attr_shift(NTFSAttribute* &attr, size_t value) {
-    return attr = (NTFSAttribute*) (((char*) attr) + value);
+// the record from the window being analized, already fixed up, or null if it isn't there or is bad
+NTFSMftEntry* NTFS::window_record(uint64_t fr_num) {
+    const uint64_t* found = std::lower_bound(window_nums_, window_nums_ + window_count_, fr_num);
+    if (found == window_nums_ + window_count_ || *found != fr_num || !window_valid_[found - window_nums_]) {
+        return nullptr;
+    }
+    return (NTFSMftEntry*) (window_records_ + (found - window_nums_) * fr_size_);
+}
+
+void NTFS::read_record(uint64_t fr_num, char* buffer) {
+    char valid;
+    read_records(&fr_num, 1, buffer, &valid);
+    if (!valid) {
+        throw std::runtime_error("bad file record");
+    }
+}
+
+// the records one after another in records, fixed up together
+void NTFS::read_records(const uint64_t* fr_nums, int count, char* records, char* valid) {
+    {
+        ReadSiteScope site(read_site_, ScanStats::READ_MFT_RECORD);
+        for (int i = 0; i < count; i++) {
+            read_fr(0, 128, nullptr, fr_nums[i] * fr_size_, fr_size_, records + i * fr_size_);
+        }
+    }
+    fixup_records(records, count, valid);
+}
+
+size_t NTFS::read_al_entry(NTFSAttribute* attr, size_t offset, NTFSAttrListEntry* list_entry) {
+    ReadSiteScope site(read_site_, ScanStats::READ_ATTR_LIST);
+    return read_attr((char*) attr, offset, 280, (char*) list_entry);
 }
 
 size_t NTFS::read_fr(uint64_t fr_num, uint32_t type, char* name, size_t offset, size_t count, char* str) {
@@ -115,8 +262,7 @@ size_t NTFS::read_fr(uint64_t fr_num, uint32_t type, char* name, size_t offset,
     if (fr_num == 0) {
         fr = mft_fr_;
     } else {
-        read_fr(0, 128, nullptr, fr_num * fr_size_, fr_size_, (char*) fr);
-        fixup((char*) fr);
+        read_record(fr_num, (char*) fr);
     }
 
     NTFSAttribute* attr = (NTFSAttribute*) (((char*) fr) + fr->first_attr_offset);
@@ -146,12 +292,13 @@ size_t NTFS::read_fr(uint64_t fr_num, uint32_t type, char* name, size_t offset,
 
 size_t NTFS::read_al(NTFSMftEntry *fr, NTFSAttribute* attr, uint64_t fr_num, uint32_t type,
                      char* name, size_t offset, size_t count, char* str) {
-    std::unique_ptr<char> list_entry_prt(new char[280]);
-    NTFSAttrListEntry* list_entry = (NTFSAttrListEntry*)list_entry_prt.get();
+    Arena::Scope scope(scratch_);
+    NTFSAttrListEntry* list_entry = (NTFSAttrListEntry*) scratch_.allocate(280);
     size_t list_entry_offset = 0;
     size_t bytes_read = 0;
+    SCAN_STAT_ADD(attr_list_resolutions, 1);
 
-    while (count && read_attr((char*) attr, list_entry_offset, 280, (char*) list_entry)) {
+    while (count && read_al_entry(attr, list_entry_offset, list_entry)) {
         list_entry_offset += list_entry->entry_len;
 
         if (list_entry->type_id == 0) {
@@ -173,15 +320,13 @@ size_t NTFS::read_al(NTFSMftEntry *fr, NTFSAttribute* attr, uint64_t fr_num, uin
         uint64_t nonbase_fr_num = list_entry->fr;
         unsigned attr_id = list_entry->attr_id;
 
-        std::unique_ptr<char> nbfr_placeholder;
+        Arena::Scope entry_scope(scratch_);
 
         if (fr_num == nonbase_fr_num) {
             nonbase_fr = fr;
         } else {
-            nbfr_placeholder = std::unique_ptr<char>(new char[fr_size_]);
-            nonbase_fr = (NTFSMftEntry*) nbfr_placeholder.get();
-            read_fr(0, 128, nullptr, nonbase_fr_num * fr_size_, fr_size_, (char*) nonbase_fr);
-            fixup((char*) nonbase_fr);
+            nonbase_fr = (NTFSMftEntry*) scratch_.allocate(fr_size_);
+            read_record(nonbase_fr_num, (char*) nonbase_fr);
         }
 
         for (NTFSAttribute* tmp_attr =
@@ -223,73 +368,102 @@ size_t NTFS::read_attr(char* attr_header, uint64_t offset, size_t count, char* s
 }
 
 size_t NTFS::read_runlist(uint64_t offset, size_t count, char* str, NTFSRunlistEntry* run_format) {
-    uint length_mod = (1 << (8 * run_format->runlen_length));
-    uint64_t run_length = (*((uint64_t*) (run_format + 1))) % length_mod;
-    int offset_size = 8 * run_format->offset_length;
-    uint64_t run_offset = (((*((int64_t*) (run_format + 1 +
-            run_format->runlen_length))) << (64 - offset_size)) >> (64 - offset_size));
     size_t bytes_read = 0;
-    uint64_t vcn = 0;
-
-    while (*(char*) run_format && count) {
+    walk_runlist(run_format, 0, [&](uint64_t vcn, uint64_t lcn, uint64_t run_length, bool sparse) {
+        if (!count) {
+            return;
+        }
         if (offset < vcn * cluster_size_) {
             throw std::runtime_error("DATA MISSING");
         }
-
-        size_t new_bytes_read = 0;
         if ((vcn + run_length) * cluster_size_ > offset) { // check if offset is out of this run
-            new_bytes_read = MIN(count,(run_length + vcn) * cluster_size_ - offset);
-            if (offset_size) {
-                disk_->read(str, new_bytes_read, (run_offset - vcn) * cluster_size_ + offset);
-            } else {
-                //sparse
+            size_t new_bytes_read = MIN(count, (vcn + run_length) * cluster_size_ - offset);
+            if (sparse) {
                 memset(str, 0, new_bytes_read);
+            } else {
+                read(read_site_, str, new_bytes_read, (lcn - vcn) * cluster_size_ + offset);
             }
+            offset += new_bytes_read;
+            count -= new_bytes_read;
+            str += new_bytes_read;
+            bytes_read += new_bytes_read;
         }
-        //go to the next entry in the run list
-        run_format = run_format + 1 + run_format->runlen_length + run_format->offset_length;
-        vcn += run_length;
-        length_mod = (1 << (8 * run_format->runlen_length));
-        run_length = (*((uint64_t*) (run_format + 1))) % length_mod;
-        offset_size = 8 * run_format->offset_length;
-        run_offset = run_offset + (((*((int64_t*) (run_format + 1 +
-                run_format->runlen_length))) << (64 - offset_size)) >> (64 - offset_size));
-
-        offset += new_bytes_read;
-        count -= new_bytes_read;
-        str += new_bytes_read;
-        bytes_read += new_bytes_read;
-    } // while run list isn't read
-
+    });
     return bytes_read;
 }
 
-size_t NTFS::analize_fr(BlockFunc& printBlock, MetadataFunc& printMetadata, uint64_t fr_num) {
-    std::unique_ptr<char> fr_placeholder;
-    NTFSMftEntry *fr;
-    if (fr_num == 0) {
-        fr = mft_fr_;
-    } else {
-        fr_placeholder = std::unique_ptr<char>(new char[fr_size_]);
-        fr = (NTFSMftEntry*) fr_placeholder.get();
-        read_fr(0, 128, nullptr, fr_num * fr_size_, fr_size_, (char*) fr);
-        fixup((char*) fr);
-    }
-
+size_t NTFS::analize_fr(BlockFunc& printBlock, MetadataFunc& printMetadata, uint64_t fr_num, NTFSMftEntry* fr) {
+    SCAN_STAT_ADD(records_visited, 1);
     NTFSAttribute* basic_attr = (NTFSAttribute*) (((char*) fr) + fr->first_attr_offset);
     uint64_t base_fr_num = fr->base_fr == 0 ? fr_num : fr->base_fr;
 
+    if (!filter_.accepts_file(base_fr_num)) {
+        return 0;
+    }
+
+    NTFSAttribute* al_attr = nullptr;
     for (; basic_attr->type_id != 0xffffffff; attr_shift(basic_attr, basic_attr->attr_len)) {
+        if (basic_attr->type_id == 32) {
+            al_attr = basic_attr;
+        }
         if (basic_attr->nonresident_flag) {
-            analize_nonres_attr(printBlock, fr_num, (NTFSNonresidentAttr*) basic_attr, base_fr_num);
+            if (filter_.accepts_attr(basic_attr->type_id)) {
+                analize_nonres_attr(printBlock, fr_num, (NTFSNonresidentAttr*) basic_attr, base_fr_num);
+            }
         } else {
             analize_res_attr(printMetadata, fr_num, (NTFSResidentAttr*) basic_attr, base_fr_num);
         }
     }
 
+    if (al_attr && base_fr_num == fr_num &&
+            (filter_.first_file != 0 || filter_.last_file != UINT64_MAX)) {
+        analize_ext_records(printBlock, printMetadata, al_attr, fr_num);
+    }
+
     return 0;
 }
 
+void NTFS::analize_ext_records(BlockFunc& printBlock, MetadataFunc& printMetadata,
+                               NTFSAttribute* al_attr, uint64_t fr_num) {
+    // the bitmap scan doesn't reach extension records outside of the filtered range,
+    // so they are pulled in through the attribute list of their base record
+    uint64_t al_size = al_attr->nonresident_flag ?
+            ((NTFSNonresidentAttr*) al_attr)->actual_content_size :
+            ((NTFSResidentAttr*) al_attr)->content_size;
+    Arena::Scope scope(scratch_);
+    char* al = scratch_.allocate(al_size);
+    {
+        ReadSiteScope site(read_site_, ScanStats::READ_ATTR_LIST);
+        al_size = read_attr((char*) al_attr, 0, al_size, al);
+    }
+    SCAN_STAT_ADD(attr_list_resolutions, 1);
+
+    uint64_t* visited = (uint64_t*) scratch_.allocate(al_size / sizeof(NTFSAttrListEntry) * sizeof(uint64_t));
+    size_t visited_count = 0;
+    for (size_t offset = 0; offset + sizeof(NTFSAttrListEntry) <= al_size;) {
+        NTFSAttrListEntry* list_entry = (NTFSAttrListEntry*) (al + offset);
+        if (list_entry->type_id == 0 || list_entry->entry_len == 0) {
+            break;
+        }
+        offset += list_entry->entry_len;
+
+        uint64_t ext_fr_num = list_entry->fr;
+        if (ext_fr_num == fr_num || filter_.accepts_file(ext_fr_num) ||
+                std::find(visited, visited + visited_count, ext_fr_num) != visited + visited_count) {
+            continue;
+        }
+        visited[visited_count++] = ext_fr_num;
+
+        Arena::Scope record_scope(scratch_);
+        NTFSMftEntry* ext_fr = (NTFSMftEntry*) scratch_.allocate(fr_size_);
+        char valid;
+        read_records(&ext_fr_num, 1, (char*) ext_fr, &valid);
+        if (count_checksum(valid)) {
+            analize_fr(printBlock, printMetadata, ext_fr_num, ext_fr);
+        }
+    }
+}
+
 size_t NTFS::analize_nonres_attr(BlockFunc& printBlock, uint64_t fr_num,
                                  NTFSNonresidentAttr* attr, uint64_t base_fr_num) {
     char16_t attr_name[127];
@@ -305,14 +479,9 @@ size_t NTFS::analize_nonres_attr(BlockFunc& printBlock, uint64_t fr_num,
         actual_size = read_fr_for_attr_size(base_fr_num, attr->type_id, attr->name_len ? (char*) attr_name : nullptr);
     }
 
-    NTFSRunlistEntry* run_format = ((NTFSRunlistEntry*) attr + attr->runlist_offset);
-    uint length_mod = (1 << (8 * run_format->runlen_length));
-    uint64_t run_length = (*((uint64_t*) (run_format + 1))) % length_mod;
-    int offset_size = 8 * run_format->offset_length;
-    uint64_t run_offset = (((*((int64_t*) (run_format + 1 +
-            run_format->runlen_length))) << (64 - offset_size)) >> (64 - offset_size));
-
-    uint64_t vcn = attr->start_vcn;
+    if (!filter_.accepts_size(actual_size)) {
+        return 0;
+    }
 
     std::string attr_name8;
     attr_name8.resize(attr->name_len * 2);
@@ -323,18 +492,15 @@ size_t NTFS::analize_nonres_attr(BlockFunc& printBlock, uint64_t fr_num,
     std::string fileId = std::to_string(base_fr_num) + ":" +
             std::to_string(attr->type_id) + ":" + attr_name8;
 
-    while (*(char*) run_format) {
-
-        printBlock(fileId, actual_size, vcn, run_offset, run_length);
+    // sparse runs have no clusters, only the allocated ones are reported
+    for_each_run(attr, [&](uint64_t vcn, uint64_t lcn, uint64_t run_length) {
+        if (filter_.accepts_range(lcn, run_length)) {
+            SCAN_STAT_TIMER(callback_ns);
+            printBlock(fileId, actual_size, vcn, lcn, run_length);
+        }
+    });
 
-        run_format = run_format + 1 + run_format->runlen_length + run_format->offset_length;
-        vcn += run_length;
-        length_mod = (1 << (8 * run_format->runlen_length));
-        run_length = (*((uint64_t*) (run_format + 1))) % length_mod;
-        offset_size = 8 * run_format->offset_length;
-        run_offset = run_offset + (((*((int64_t*) (run_format + 1 +
-                run_format->runlen_length))) << (64 - offset_size)) >> (64 - offset_size));
-    } // while run list isn't read
+    return 0;
 }
 
 size_t NTFS::analize_res_attr(MetadataFunc& printMetadata, uint64_t fr_num,
@@ -347,49 +513,244 @@ size_t NTFS::analize_res_attr(MetadataFunc& printMetadata, uint64_t fr_num,
         bool encrypt_flag = flags & 0x4000;
 
         if (base_fr_num == fr_num) {
-
-            printMetadata(fr_num, read_fr_for_attr_size(fr_num, 128, nullptr),
-        compressed_flag, encrypt_flag, std_info->ctime, std_info->mtime, std_info->atime);
+            uint64_t file_size = read_fr_for_attr_size(fr_num, 128, nullptr);
+            if (filter_.accepts_size(file_size)) {
+                SCAN_STAT_TIMER(callback_ns);
+                printMetadata(fr_num, file_size, compressed_flag, encrypt_flag,
+                              std_info->ctime, std_info->mtime, std_info->atime);
+            }
+        }
+    } else if (attr->type_id == 48 && paths_) {
+        NTFSFileName* file_name = (NTFSFileName*) (((char*) attr) + attr->content_offset);
+        // DOS names are 8.3 aliases of a long name in another $FILE_NAME
+        if (file_name->name_space != 2) {
+            char16_t name16[255];
+            char name8[3 * 255];
+            memcpy(name16, file_name->name, file_name->name_len * 2);
+            size_t name_len = utf16_to_utf8(name16, name16 + file_name->name_len, name8, name8 + sizeof(name8));
+            paths_->add(base_fr_num, file_name->parent_fr, name8, name_len);
         }
     }
+    return 0;
+}
+
+void NTFS::Parse(BlockFunc& printBlock, MetadataFunc& printMetadata, const ScanFilter& filter) {
+    uint64_t first, end;
+    begin_scan(filter, first, end);
+    parse_units(printBlock, printMetadata, first, end);
 }
 
-void NTFS::Parse(BlockFunc& printBlock, MetadataFunc& printMetadata) {
-    const unsigned byte_count = 512;
-    std::unique_ptr<char[]> bitmap_block(new char[byte_count]);
+void NTFS::begin_scan(const ScanFilter& filter, uint64_t& first, uint64_t& end) {
+    filter_ = filter;
+    end = (scan_bitmap_size() + BITMAP_CHUNK_SIZE - 1) / BITMAP_CHUNK_SIZE;
+    first = MIN(filter_.first_file / 8 / BITMAP_CHUNK_SIZE, end);
+}
 
-    uint64_t bitmap_size = read_fr_for_attr_size(0, 176, nullptr);
+void NTFS::parse_units(BlockFunc& printBlock, MetadataFunc& printMetadata, uint64_t first, uint64_t end) {
+    uint64_t bitmap_size = scan_bitmap_size();
+    for (uint64_t offset = first * BITMAP_CHUNK_SIZE; offset < end * BITMAP_CHUNK_SIZE; offset += BITMAP_CHUNK_SIZE) {
+        // the records of the next chunk, while this one is analized
+        if (offset + BITMAP_CHUNK_SIZE < end * BITMAP_CHUNK_SIZE) {
+            prefetch_records(8 * (offset + BITMAP_CHUNK_SIZE),
+                    8 * MIN(BITMAP_CHUNK_SIZE, bitmap_size - offset - BITMAP_CHUNK_SIZE));
+        }
+        analize_bitmap_chunk(printBlock, printMetadata, offset, MIN(BITMAP_CHUNK_SIZE, bitmap_size - offset));
+    }
+}
+
+// bytes of the $MFT bitmap up to the last record the filter takes
+uint64_t NTFS::scan_bitmap_size() {
     //type == 176 for $BITMAP attribute
-    for (uint64_t offset = 0; offset < bitmap_size; offset += byte_count) {
-        if (offset > 10500) {
-            int asd = 1123;
-        }
-        size_t br = read_fr(0, 176, 0, offset, MIN(byte_count, bitmap_size - offset), bitmap_block.get());
-        for (int i = 0; i < br; i++) {
-            if (bitmap_block[i]) {
-               if (i == 210) {
-                    int ggggg=123;
-               }
-                for (int j = 0; j < 8; j++) {
-                    if (bitmap_block[i] & (1 << j)) {
-                        analize_fr(printBlock, printMetadata, 8 * (offset + i) + j);
-                    }
+    uint64_t bitmap_size = read_fr_for_attr_size(0, 176, nullptr);
+    return filter_.last_file / 8 < bitmap_size ? filter_.last_file / 8 + 1 : bitmap_size;
+}
+
+void NTFS::analize_bitmap_chunk(BlockFunc& printBlock, MetadataFunc& printMetadata,
+                                uint64_t offset, size_t count) {
+    char bitmap_block[BITMAP_CHUNK_SIZE];
+    size_t br;
+    {
+        ReadSiteScope site(read_site_, ScanStats::READ_MFT_BITMAP);
+        br = read_fr(0, 176, 0, offset, count, bitmap_block);
+    }
+    uint64_t window[SCHED_WINDOW];
+    int window_size = 0;
+    int window_end = window_capacity();
+    for (size_t i = 0; i < br; i++) {
+        if (bitmap_block[i]) {
+            for (int j = 0; j < 8; j++) {
+                if (bitmap_block[i] & (1 << j) && filter_.accepts_file(8 * (offset + i) + j)) {
+                    window[window_size++] = 8 * (offset + i) + j;
+                }
+                if (window_size == window_end) {
+                    analize_window(printBlock, printMetadata, window, window_size);
+                    window_size = 0;
                 }
             }
         }
     }
-    int a = 123;
+    analize_window(printBlock, printMetadata, window, window_size);
+}
+
+void NTFS::analize_window(BlockFunc& printBlock, MetadataFunc& printMetadata,
+                          const uint64_t* window, int count) {
+    // the records first, then base records and attribute lists they refer to,
+    // then extension records from the attribute lists, each round in disk order
+    for (int i = 0; i < count; i++) {
+        schedule_record(window[i]);
+    }
+    issue_reads();
+
+    // read and fixed up once for the rounds and the analysis, a bad record is skipped
+    Arena::Scope scope(scratch_);
+    char* records = scratch_.allocate(count * fr_size_);
+    char* valid = scratch_.allocate(count);
+    read_records(window, count, records, valid);
+    for (int i = 0; i < count; i++) {
+        count_checksum(valid[i]);
+    }
+
+    for (int round = 0; round < 2; round++) {
+        for (int i = 0; i < count; i++) {
+            if (window[i] == 0 || !valid[i]) {
+                continue;
+            }
+            NTFSMftEntry* fr = (NTFSMftEntry*) (records + i * fr_size_);
+            if (round == 0 && fr->base_fr) {
+                schedule_record(fr->base_fr);
+            }
+            NTFSAttribute* attr = (NTFSAttribute*) (((char*) fr) + fr->first_attr_offset);
+            for (; attr->type_id != 0xffffffff && attr->type_id <= 32; attr_shift(attr, attr->attr_len)) {
+                if (attr->type_id != 32) {
+                    continue;
+                }
+                if (round == 0 && attr->nonresident_flag) {
+                    for_each_run((NTFSNonresidentAttr*) attr, [this](uint64_t, uint64_t lcn, uint64_t length) {
+                        sched_->add(ScanStats::READ_ATTR_LIST, lcn * cluster_size_, length * cluster_size_);
+                    });
+                } else if (round == 1 && fr->base_fr == 0) {
+                    schedule_al_records(attr);
+                }
+            }
+        }
+        issue_reads();
+    }
+
+    // sizes kept in base records are taken from here rather than read again
+    window_nums_ = window;
+    window_records_ = records;
+    window_valid_ = valid;
+    window_count_ = count;
+    for (int i = 0; i < count; i++) {
+        if (valid[i]) {
+            analize_fr(printBlock, printMetadata, window[i], (NTFSMftEntry*) (records + i * fr_size_));
+        }
+    }
+    window_count_ = 0;
+    sched_->reset();
+}
+
+void NTFS::schedule_record(uint64_t fr_num) {
+    uint64_t vcn = fr_num * fr_size_ / cluster_size_;
+    uint64_t vcn_offset = fr_num * fr_size_ % cluster_size_;
+    for (const MftRun& run : mft_runs_) {
+        // records crossing runs are left to read_fr
+        if (run.vcn <= vcn && (vcn - run.vcn) * cluster_size_ + vcn_offset + fr_size_ <= run.length * cluster_size_) {
+            sched_->add(ScanStats::READ_MFT_RECORD, (run.lcn + vcn - run.vcn) * cluster_size_ + vcn_offset, fr_size_);
+            return;
+        }
+    }
+}
+
+void NTFS::prefetch_records(uint64_t first_fr, uint64_t count) {
+    uint64_t begin = first_fr * fr_size_, end = (first_fr + count) * fr_size_;
+    for (const MftRun& run : mft_runs_) {
+        uint64_t run_begin = run.vcn * cluster_size_, run_end = (run.vcn + run.length) * cluster_size_;
+        if (run_begin < end && begin < run_end) {
+            uint64_t from = std::max(begin, run_begin), to = std::min(end, run_end);
+            disk_->prefetch(run.lcn * cluster_size_ + (from - run_begin), to - from);
+        }
+    }
+}
+
+void NTFS::schedule_al_records(NTFSAttribute* al_attr) {
+    uint64_t al_size = al_attr->nonresident_flag ?
+            ((NTFSNonresidentAttr*) al_attr)->actual_content_size :
+            ((NTFSResidentAttr*) al_attr)->content_size;
+    Arena::Scope scope(scratch_);
+    char* al = scratch_.allocate(al_size);
+    {
+        ReadSiteScope site(read_site_, ScanStats::READ_ATTR_LIST);
+        al_size = read_attr((char*) al_attr, 0, al_size, al);
+    }
+
+    for (size_t offset = 0; offset + sizeof(NTFSAttrListEntry) <= al_size;) {
+        NTFSAttrListEntry* list_entry = (NTFSAttrListEntry*) (al + offset);
+        if (list_entry->type_id == 0 || list_entry->entry_len == 0) {
+            break;
+        }
+        offset += list_entry->entry_len;
+        schedule_record(list_entry->fr);
+    }
+}
+
+uint64_t NTFS::buffer_bytes() {
+    return scratch_.capacity() + sched_->capacity() + 2 * fr_size_;
+}
+
+// records per window, fewer if the budget can't hold a record and an extension record for each
+int NTFS::window_capacity() {
+    uint64_t fitting = sched_->budget() / (2 * fr_size_);
+    return fitting < 1 ? 1 : std::min<uint64_t>(fitting, SCHED_WINDOW);
+}
+
+uint64_t NTFS::unit_count() {
+    return (read_fr_for_attr_size(0, 176, nullptr) + BITMAP_CHUNK_SIZE - 1) / BITMAP_CHUNK_SIZE;
+}
+
+uint64_t NTFS::unit_bytes() {
+    return BITMAP_CHUNK_SIZE + 8 * BITMAP_CHUNK_SIZE * fr_size_;
+}
+
+bool NTFS::lookup_file(uint64_t file_num, BlockFunc& printBlock, MetadataFunc& printMetadata) {
+    if (file_num / 8 >= read_fr_for_attr_size(0, 176, nullptr)) {
+        return false;
+    }
+    char bitmap_byte;
+    size_t br;
+    {
+        ReadSiteScope site(read_site_, ScanStats::READ_MFT_BITMAP);
+        br = read_fr(0, 176, 0, file_num / 8, 1, &bitmap_byte);
+    }
+    if (br == 0 || !(bitmap_byte & (1 << file_num % 8))) {
+        return false;
+    }
+
+    Arena::Scope scope(scratch_);
+    NTFSMftEntry* fr = (NTFSMftEntry*) scratch_.allocate(fr_size_);
+    schedule_record(file_num);
+    issue_reads();
+    // a damaged record is no file to look up, like an extension record
+    char valid;
+    read_records(&file_num, 1, (char*) fr, &valid);
+    if (!valid || fr->base_fr) {
+        sched_->reset();
+        return false;
+    }
+
+    // extension records outside of the filter are pulled in through the attribute list
+    filter_ = ScanFilter();
+    filter_.first_file = filter_.last_file = file_num;
+    analize_window(printBlock, printMetadata, &file_num, 1);
+    return true;
 }
 
 uint64_t NTFS::read_fr_for_attr_size(uint64_t base_fr_num, uint32_t type, char* name) {
     //careful!! don't call read_fr or read_fr_for_attr_size from read_fr_for_attr_size for non-zero fr_num!!
-    NTFSMftEntry *fr = tmp_fr_;
-
-    if (base_fr_num == 0) {
-        fr = mft_fr_;
-    } else {
-        read_fr(0, 128, nullptr, base_fr_num * fr_size_, fr_size_, (char*) fr);
-        fixup((char*) fr);
+    NTFSMftEntry *fr = base_fr_num == 0 ? mft_fr_ : window_record(base_fr_num);
+    if (fr == nullptr) {
+        fr = tmp_fr_;
+        read_record(base_fr_num, (char*) fr);
     }
     NTFSAttribute *attr = (NTFSAttribute*) (((char*) fr)+ fr->first_attr_offset);
 
@@ -418,9 +779,11 @@ uint64_t NTFS::read_al_for_attr_size(NTFSAttribute *attr, NTFSMftEntry *fr,
                 ((NTFSNonresidentAttr*) attr)->actual_content_size :
                 ((NTFSResidentAttr*) attr)->content_size);
 
+    SCAN_STAT_ADD(attr_list_resolutions, 1);
+
     for (size_t list_entry_offset = 0;
             list_entry_offset < attr_list_size &&
-                read_attr((char*) attr, list_entry_offset, 280, (char*) list_entry);
+                read_al_entry(attr, list_entry_offset, list_entry);
             list_entry_offset += list_entry->entry_len) {
 
         if (list_entry_offset == 184 &&
@@ -436,15 +799,13 @@ uint64_t NTFS::read_al_for_attr_size(NTFSAttribute *attr, NTFSMftEntry *fr,
         NTFSMftEntry* nonbase_fr;
         uint64_t nonbase_fr_num = list_entry->fr;
 
-        std::unique_ptr<char> nbfr_placeholder;
+        Arena::Scope scope(scratch_);
 
         if (base_fr_num == nonbase_fr_num) {
             nonbase_fr = fr;
-        } else {
-            nbfr_placeholder = std::unique_ptr<char>(new char[fr_size_]);
-            nonbase_fr = (NTFSMftEntry*) nbfr_placeholder.get();
-            read_fr(0, 128, nullptr, nonbase_fr_num * fr_size_, fr_size_, (char*) nonbase_fr);
-            fixup((char*) nonbase_fr);
+        } else if ((nonbase_fr = window_record(nonbase_fr_num)) == nullptr) {
+            nonbase_fr = (NTFSMftEntry*) scratch_.allocate(fr_size_);
+            read_record(nonbase_fr_num, (char*) nonbase_fr);
         }
 
         NTFSAttribute* tmp_attr = (NTFSAttribute*) (((char*) nonbase_fr) + nonbase_fr->first_attr_offset);
@@ -0,0 +1,119 @@
+#include "FS.h"
+
+#include <memory>
+
+enum PartitionConsts {
+    MBR_SECTOR_SIZE = 512,
+    MBR_SIGNATURE = 0xaa55,
+    MBR_TYPE_GPT = 0xee,
+    MBR_MAX_LOGICAL = 128, // bounds a looping EBR chain
+    GPT_MAX_ENTRIES = 1024
+};
+
+namespace {
+
+bool is_extended(uint8_t type) {
+    return type == 0x05 || type == 0x0f || type == 0x85;
+}
+
+void add_partition(std::vector<Partition>& partitions, uint32_t number, uint64_t offset, uint64_t size) {
+    partitions.push_back({number, offset, size, FS_UNKNOWN});
+}
+
+// the logical partitions, each one behind an EBR of the chain starting at the extended partition
+void find_logical_partitions(std::shared_ptr<Disk> disk, uint64_t extended_lba, std::vector<Partition>& partitions) {
+    MBR ebr;
+    uint64_t ebr_lba = extended_lba;
+    for (uint32_t number = 5; number < 5 + MBR_MAX_LOGICAL; number++) {
+        disk->read(&ebr, sizeof(MBR), ebr_lba * MBR_SECTOR_SIZE);
+        if (ebr.signature != MBR_SIGNATURE) {
+            return;
+        }
+
+        const MBRPartitionEntry& logical = ebr.partitions[0];
+        if (logical.type && logical.sector_count) {
+            add_partition(partitions, number, (ebr_lba + logical.first_lba) * MBR_SECTOR_SIZE,
+                          (uint64_t) logical.sector_count * MBR_SECTOR_SIZE);
+        }
+
+        const MBRPartitionEntry& next = ebr.partitions[1];
+        if (!is_extended(next.type) || next.first_lba == 0) {
+            return;
+        }
+        ebr_lba = extended_lba + next.first_lba;
+    }
+}
+
+bool find_gpt_partitions(std::shared_ptr<Disk> disk, std::vector<Partition>& partitions) {
+    GPTHeader header;
+    // 512 byte or 4K native logical sectors
+    for (uint64_t sector_size : {512, 4096}) {
+        disk->read(&header, sizeof(GPTHeader), sector_size);
+        if (memcmp(header.signature, "EFI PART", 8) || header.entry_size < sizeof(GPTEntry)) {
+            continue;
+        }
+
+        uint32_t entry_count = std::min<uint32_t>(header.entry_count, GPT_MAX_ENTRIES);
+        std::unique_ptr<char[]> entries(new char[(size_t) entry_count * header.entry_size]);
+        disk->read(entries.get(), (size_t) entry_count * header.entry_size, header.entries_lba * sector_size);
+
+        static const uint8_t unused[16] = {0};
+        for (uint32_t i = 0; i < entry_count; i++) {
+            const GPTEntry* entry = (const GPTEntry*) (entries.get() + (size_t) i * header.entry_size);
+            if (!memcmp(entry->type_guid, unused, sizeof(unused)) || entry->last_lba < entry->first_lba) {
+                continue;
+            }
+            add_partition(partitions, i + 1, entry->first_lba * sector_size,
+                          (entry->last_lba - entry->first_lba + 1) * sector_size);
+        }
+        return true;
+    }
+    return false;
+}
+
+}
+
+std::vector<Partition> FindPartitions(std::shared_ptr<Disk> disk) {
+    std::vector<Partition> partitions;
+    // an NTFS boot sector carries the MBR signature too
+    if (FSParser::Detect(disk) != FS_UNKNOWN) {
+        return partitions;
+    }
+
+    MBR mbr;
+    disk->read(&mbr, sizeof(MBR), 0);
+    if (mbr.signature != MBR_SIGNATURE) {
+        return partitions;
+    }
+
+    bool gpt = false;
+    for (const MBRPartitionEntry& entry : mbr.partitions) {
+        if (entry.type == MBR_TYPE_GPT) {
+            gpt = find_gpt_partitions(disk, partitions);
+            break;
+        }
+    }
+
+    for (uint32_t i = 0; i < 4 && !gpt; i++) {
+        const MBRPartitionEntry& entry = mbr.partitions[i];
+        if (entry.type == 0 || entry.sector_count == 0 || (entry.status != 0 && entry.status != 0x80)) {
+            continue;
+        }
+        if (is_extended(entry.type)) {
+            find_logical_partitions(disk, entry.first_lba, partitions);
+        } else {
+            add_partition(partitions, i + 1, (uint64_t) entry.first_lba * MBR_SECTOR_SIZE,
+                          (uint64_t) entry.sector_count * MBR_SECTOR_SIZE);
+        }
+    }
+
+    for (Partition& partition : partitions) {
+        try {
+            partition.filesystem = FSParser::Detect(std::shared_ptr<Disk>(
+                    new DiskWindow(disk, partition.offset, partition.size)));
+        } catch (const std::runtime_error&) {
+            // too small or unaligned for a filesystem
+        }
+    }
+    return partitions;
+}
@@ -0,0 +1,343 @@
+#include "FS.h"
+
+namespace {
+
+const uint32_t FILES_PER_BLOCK = 64;
+
+void put_varint(std::vector<uint8_t>& out, uint64_t value) {
+    while (value >= 0x80) {
+        out.push_back(value | 0x80);
+        value >>= 7;
+    }
+    out.push_back(value);
+}
+
+uint64_t get_varint(const uint8_t*& in) {
+    uint64_t value = 0;
+    for (int shift = 0;; shift += 7) {
+        uint8_t byte = *in++;
+        value |= (uint64_t) (byte & 0x7f) << shift;
+        if (!(byte & 0x80)) {
+            return value;
+        }
+    }
+}
+
+// small negative differences stay small
+uint64_t zigzag(uint64_t value) {
+    return (value << 1) ^ (uint64_t) ((int64_t) value >> 63);
+}
+
+uint64_t unzigzag(uint64_t value) {
+    return (value >> 1) ^ (0 - (value & 1));
+}
+
+// numeric prefix of the id + 1 (0 if there's none) and the rest of it. Digits with a leading
+// zero or too many to fit are left in the rest, so the id can be joined back.
+uint64_t split_id(const std::string& file_id, std::string& tail_id) {
+    size_t digits = 0;
+    while (digits < file_id.size() && digits < 19 && file_id[digits] >= '0' && file_id[digits] <= '9') {
+        digits++;
+    }
+    if (digits > 1 && file_id[0] == '0') {
+        digits = 0;
+    }
+    tail_id = file_id.substr(digits);
+    return digits ? std::stoull(file_id.substr(0, digits)) + 1 : 0;
+}
+
+int varint_size(uint64_t value) {
+    int size = 1;
+    while (value >= 0x80) {
+        value >>= 7;
+        size++;
+    }
+    return size;
+}
+
+bool overlaps(uint64_t first, uint64_t first_len, uint64_t second, uint64_t second_len) {
+    return first <= second ? second - first < first_len : first - second < second_len;
+}
+
+}
+
+// what a file is encoded against: the file before it in the same block
+struct ExtentStore::Context {
+    Context() : number(0), tail(UINT32_MAX), phys_end(0) {}
+
+    uint64_t number;
+    uint32_t tail;
+    uint64_t phys_end;
+};
+
+ExtentStore::ExtentStore() : size_shift_(0), file_count_(0), extent_count_(0) {}
+
+void ExtentStore::add(const std::string& file_id, uint64_t file_size, uint64_t offset,
+                      uint64_t phys_offset, uint64_t length) {
+    if (length == 0) {
+        return;
+    }
+    if (current_.extents.empty() || file_id != current_id_) {
+        add_piece();
+        current_id_ = file_id;
+        std::string tail_id;
+        current_.number = split_id(file_id, tail_id);
+        current_.tail = intern_tail(tail_id);
+    }
+    current_.size = file_size;
+    current_.extents.push_back({offset, phys_offset, length});
+}
+
+void ExtentStore::add_piece() {
+    if (current_.extents.empty()) {
+        return;
+    }
+    Context context;
+    piece_offsets_.push_back(pieces_.size());
+    encode_file(pieces_, context, current_, 0);
+    current_.extents.clear();
+}
+
+void ExtentStore::finish() {
+    // files already encoded go back to the pieces to be merged with the new ones
+    for_each_file(0, blocks_.size(), [this](const File& file) {
+        Context context;
+        piece_offsets_.push_back(pieces_.size());
+        encode_file(pieces_, context, file, 0);
+        return true;
+    });
+    add_piece();
+    data_.clear();
+    blocks_.clear();
+    file_count_ = extent_count_ = 0;
+
+    struct PieceId {
+        uint64_t number;
+        uint32_t tail;
+        size_t piece;
+    };
+    std::vector<PieceId> ids;
+    File file;
+    // sizes are stored against the end of the last extent in units of 1 << size_shift_,
+    // the shift (usually the block size) that takes the fewest bytes is picked
+    const int SHIFTS = 21;
+    uint64_t size_bytes[SHIFTS] = {0};
+    for (size_t piece = 0; piece < piece_offsets_.size(); piece++) {
+        Context context;
+        decode_file(pieces_.data() + piece_offsets_[piece], context, file, 0);
+        ids.push_back({file.number, file.tail, piece});
+        uint64_t end = file.extents.back().offset + file.extents.back().length;
+        for (int shift = 0; shift < SHIFTS; shift++) {
+            size_bytes[shift] += varint_size(zigzag(file.size - (end << shift)));
+        }
+    }
+    size_shift_ = std::min_element(size_bytes, size_bytes + SHIFTS) - size_bytes;
+    std::sort(ids.begin(), ids.end(), [this](const PieceId& a, const PieceId& b) {
+        int order = compare_id(a.number, a.tail, b.number, b.tail);
+        return order < 0 || (order == 0 && a.piece < b.piece);
+    });
+
+    Context context;
+    File merged;
+    for (size_t first = 0; first < ids.size();) {
+        size_t last = first;
+        merged.extents.clear();
+        for (; last < ids.size() && compare_id(ids[first].number, ids[first].tail, ids[last].number, ids[last].tail) == 0; last++) {
+            Context piece_context;
+            decode_file(pieces_.data() + piece_offsets_[ids[last].piece], piece_context, file, 0);
+            merged.extents.insert(merged.extents.end(), file.extents.begin(), file.extents.end());
+        }
+        merged.number = file.number;
+        merged.tail = file.tail;
+        merged.size = file.size;
+        if (last - first > 1) {
+            std::stable_sort(merged.extents.begin(), merged.extents.end(), [](const Extent& a, const Extent& b) {
+                return a.offset < b.offset;
+            });
+        }
+
+        if (file_count_ % FILES_PER_BLOCK == 0) {
+            blocks_.push_back({merged.number, merged.tail, 0, data_.size(), UINT64_MAX, 0});
+            context = Context();
+        }
+        encode_file(data_, context, merged, size_shift_);
+        Block& block = blocks_.back();
+        block.files++;
+        for (const Extent& extent : merged.extents) {
+            block.phys_first = std::min(block.phys_first, extent.phys_offset);
+            block.phys_last = std::max(block.phys_last, extent.phys_offset + extent.length - 1);
+        }
+        file_count_++;
+        extent_count_ += merged.extents.size();
+        first = last;
+    }
+
+    std::vector<uint8_t>().swap(pieces_);
+    std::vector<size_t>().swap(piece_offsets_);
+    data_.shrink_to_fit();
+    blocks_.shrink_to_fit();
+}
+
+// header: extent count << 2, 1 if the number follows the previous one, 2 if the tail is the same,
+// then the number and tail if they differ, the size and per extent the length << 1 (1 if there's
+// a gap after the previous extent), the gap and the physical offset after the previous extent
+void ExtentStore::encode_file(std::vector<uint8_t>& out, Context& context, const File& file, int size_shift) {
+    bool next_number = file.number == context.number + 1;
+    bool same_tail = file.tail == context.tail;
+    put_varint(out, (uint64_t) file.extents.size() << 2 | (same_tail ? 2 : 0) | (next_number ? 1 : 0));
+    if (!next_number) {
+        put_varint(out, zigzag(file.number - context.number - 1));
+    }
+    if (!same_tail) {
+        put_varint(out, file.tail);
+    }
+    uint64_t last_end = file.extents.back().offset + file.extents.back().length;
+    put_varint(out, zigzag(file.size - (last_end << size_shift)));
+
+    uint64_t end = 0;
+    for (const Extent& extent : file.extents) {
+        bool gap = extent.offset != end;
+        put_varint(out, extent.length << 1 | (gap ? 1 : 0));
+        if (gap) {
+            put_varint(out, zigzag(extent.offset - end));
+        }
+        put_varint(out, zigzag(extent.phys_offset - context.phys_end));
+        end = extent.offset + extent.length;
+        context.phys_end = extent.phys_offset + extent.length;
+    }
+    context.number = file.number;
+    context.tail = file.tail;
+}
+
+const uint8_t* ExtentStore::decode_file(const uint8_t* in, Context& context, File& file, int size_shift) const {
+    uint64_t header = get_varint(in);
+    file.number = header & 1 ? context.number + 1 : context.number + 1 + unzigzag(get_varint(in));
+    file.tail = header & 2 ? context.tail : get_varint(in);
+    uint64_t size = unzigzag(get_varint(in));
+
+    file.extents.resize(header >> 2);
+    uint64_t end = 0;
+    for (Extent& extent : file.extents) {
+        uint64_t length = get_varint(in);
+        extent.length = length >> 1;
+        extent.offset = length & 1 ? end + unzigzag(get_varint(in)) : end;
+        extent.phys_offset = context.phys_end + unzigzag(get_varint(in));
+        end = extent.offset + extent.length;
+        context.phys_end = extent.phys_offset + extent.length;
+    }
+    file.size = size + (end << size_shift);
+    context.number = file.number;
+    context.tail = file.tail;
+    return in;
+}
+
+// func(file) for the files of blocks [first_block, last_block) until it returns false
+template <class FileFunc>
+void ExtentStore::for_each_file(size_t first_block, size_t last_block, FileFunc func) const {
+    File file;
+    for (size_t block = first_block; block < last_block; block++) {
+        Context context;
+        const uint8_t* in = data_.data() + blocks_[block].offset;
+        for (uint32_t i = 0; i < blocks_[block].files; i++) {
+            in = decode_file(in, context, file, size_shift_);
+            if (!func(file)) {
+                return;
+            }
+        }
+    }
+}
+
+uint32_t ExtentStore::intern_tail(const std::string& tail_id) {
+    auto it = tail_index_.find(tail_id);
+    if (it == tail_index_.end()) {
+        it = tail_index_.insert({tail_id, (uint32_t) tails_.size()}).first;
+        tails_.push_back(tail_id);
+    }
+    return it->second;
+}
+
+std::string ExtentStore::join_id(uint64_t number, uint32_t tail) const {
+    return number ? std::to_string(number - 1) + tails_[tail] : tails_[tail];
+}
+
+int ExtentStore::compare_id(uint64_t number, uint32_t tail, uint64_t other_number, uint32_t other_tail) const {
+    if (number != other_number) {
+        return number < other_number ? -1 : 1;
+    }
+    return tail == other_tail ? 0 : tails_[tail].compare(tails_[other_tail]);
+}
+
+void ExtentStore::ForEach(BlockFunc& printBlock) const {
+    for_each_file(0, blocks_.size(), [this, &printBlock](const File& file) {
+        std::string file_id = join_id(file.number, file.tail);
+        for (const Extent& extent : file.extents) {
+            printBlock(file_id, file.size, extent.offset, extent.phys_offset, extent.length);
+        }
+        return true;
+    });
+}
+
+bool ExtentStore::Find(const std::string& file_id, BlockFunc& printBlock, uint64_t offset, uint64_t length) const {
+    std::string tail_id;
+    uint64_t number = split_id(file_id, tail_id);
+    auto tail_it = tail_index_.find(tail_id);
+    if (tail_it == tail_index_.end()) {
+        return false;
+    }
+    uint32_t tail = tail_it->second;
+
+    // the last block starting at or before the file
+    auto it = std::upper_bound(blocks_.begin(), blocks_.end(), 0, [&](int, const Block& block) {
+        return compare_id(number, tail, block.first_number, block.first_tail) < 0;
+    });
+    if (it == blocks_.begin()) {
+        return false;
+    }
+    size_t block = it - blocks_.begin() - 1;
+
+    bool found = false;
+    for_each_file(block, block + 1, [&](const File& file) {
+        int order = compare_id(file.number, file.tail, number, tail);
+        if (order == 0) {
+            found = true;
+            for (const Extent& extent : file.extents) {
+                if (overlaps(extent.offset, extent.length, offset, length)) {
+                    printBlock(file_id, file.size, extent.offset, extent.phys_offset, extent.length);
+                }
+            }
+        }
+        return order < 0;
+    });
+    return found;
+}
+
+void ExtentStore::FindRange(uint64_t phys_offset, uint64_t length, BlockFunc& printBlock) const {
+    for (size_t block = 0; block < blocks_.size(); block++) {
+        if (!overlaps(blocks_[block].phys_first, blocks_[block].phys_last - blocks_[block].phys_first + 1,
+                      phys_offset, length)) {
+            continue;
+        }
+        for_each_file(block, block + 1, [&](const File& file) {
+            std::string file_id;
+            for (const Extent& extent : file.extents) {
+                if (overlaps(extent.phys_offset, extent.length, phys_offset, length)) {
+                    if (file_id.empty()) {
+                        file_id = join_id(file.number, file.tail);
+                    }
+                    printBlock(file_id, file.size, extent.offset, extent.phys_offset, extent.length);
+                }
+            }
+            return true;
+        });
+    }
+}
+
+size_t ExtentStore::memory_bytes() const {
+    size_t bytes = pieces_.capacity() + piece_offsets_.capacity() * sizeof(size_t) +
+            data_.capacity() + blocks_.capacity() * sizeof(Block);
+    for (const std::string& tail : tails_) {
+        // the string in tails_ and the key of tail_index_ with its node
+        bytes += 2 * (sizeof(std::string) + tail.capacity()) + sizeof(uint32_t) + 2 * sizeof(void*);
+    }
+    return bytes;
+}
@@ -0,0 +1,94 @@
+#include "FS.h"
+#include "test_util.h"
+
+#include <random>
+
+namespace {
+
+// bit at a time, reflected
+uint32_t reference_crc32c(uint32_t crc, const uint8_t* data, size_t size) {
+    for (size_t i = 0; i < size; i++) {
+        crc ^= data[i];
+        for (int bit = 0; bit < 8; bit++) {
+            crc = (crc >> 1) ^ (0x82f63b78 & (0 - (crc & 1)));
+        }
+    }
+    return crc;
+}
+
+uint16_t reference_crc16(uint16_t crc, const uint8_t* data, size_t size) {
+    for (size_t i = 0; i < size; i++) {
+        crc ^= data[i];
+        for (int bit = 0; bit < 8; bit++) {
+            crc = (crc >> 1) ^ (0xa001 & (0 - (crc & 1)));
+        }
+    }
+    return crc;
+}
+
+void test_check_values() {
+    const char* digits = "123456789";
+    CHECK(~crc32c(~0U, digits, 9) == 0xe3069283);
+    CHECK(crc16(0, digits, 9) == 0xbb3d);
+    CHECK(crc16(0xffff, digits, 9) == 0x4b37);
+    CHECK(crc32c(0x1234, digits, 0) == 0x1234);
+    CHECK(crc16(0x1234, digits, 0) == 0x1234);
+}
+
+// every length up to a few words and block sizes, at every alignment
+void test_against_reference() {
+    std::mt19937 random(41);
+    std::vector<uint8_t> buffer(4096 + 64);
+    for (uint8_t& byte : buffer) {
+        byte = random();
+    }
+    std::vector<size_t> sizes;
+    for (size_t size = 0; size <= 64; size++) {
+        sizes.push_back(size);
+    }
+    sizes.insert(sizes.end(), {128, 256, 1000, 1024, 4096});
+
+    for (size_t size : sizes) {
+        for (size_t align = 0; align < 8; align++) {
+            const uint8_t* data = buffer.data() + align;
+            uint32_t seed = random();
+            CHECK(crc32c(seed, data, size) == reference_crc32c(seed, data, size));
+            CHECK(crc16(seed, data, size) == reference_crc16(seed, data, size));
+        }
+        // in two parts
+        CHECK(crc32c(crc32c(~0U, buffer.data(), size / 3), buffer.data() + size / 3, size - size / 3) ==
+                reference_crc32c(~0U, buffer.data(), size));
+    }
+}
+
+// groups of four and the rest, as the inode checks batch them
+void test_multi() {
+    std::mt19937 random(42);
+    const size_t size = 256;
+    std::vector<uint8_t> buffer(9 * size + 8);
+    for (uint8_t& byte : buffer) {
+        byte = random();
+    }
+    for (int count = 1; count <= 9; count++) {
+        const void* data[9];
+        uint32_t crcs[9], expected[9];
+        for (int i = 0; i < count; i++) {
+            data[i] = buffer.data() + i * size + i % 8;
+            crcs[i] = random();
+            expected[i] = reference_crc32c(crcs[i], (const uint8_t*) data[i], size);
+        }
+        crc32c_multi(crcs, data, size, count);
+        for (int i = 0; i < count; i++) {
+            CHECK(crcs[i] == expected[i]);
+        }
+    }
+}
+
+}
+
+int main() {
+    test_check_values();
+    test_against_reference();
+    test_multi();
+    return test_result("test_checksum");
+}
@@ -0,0 +1,94 @@
+#include "FS.h"
+#include "test_util.h"
+
+#include <cstdlib>
+#include <unistd.h>
+
+namespace {
+
+struct MapExtent {
+    std::string file_id;
+    uint64_t file_size;
+    uint64_t offset;
+    uint64_t phys_offset;
+    uint64_t length;
+};
+
+// an extent map as SaveMap writes it: the magic, then per extent the id length (uint16),
+// the id and file size, offset, physical offset and length (uint64), sorted by id and offset
+std::string write_map(const std::vector<MapExtent>& extents) {
+    std::string path = "/tmp/test_diff.XXXXXX";
+    int fd = mkstemp(&path[0]);
+    CHECK(fd >= 0);
+    close(fd);
+
+    FILE* file = fopen(path.c_str(), "wb");
+    fwrite("fsxmap01", 8, 1, file);
+    for (const MapExtent& extent : extents) {
+        uint16_t id_len = extent.file_id.size();
+        uint64_t fields[4] = {extent.file_size, extent.offset, extent.phys_offset, extent.length};
+        fwrite(&id_len, sizeof(id_len), 1, file);
+        fwrite(extent.file_id.data(), 1, id_len, file);
+        fwrite(fields, sizeof(fields), 1, file);
+    }
+    CHECK(fclose(file) == 0);
+    return path;
+}
+
+bool same(const ExtentChange& change, ExtentChange::Kind kind, const std::string& file_id,
+          uint64_t offset, uint64_t length, uint64_t old_phys_offset, uint64_t new_phys_offset) {
+    return change.kind == kind && change.file_id == file_id && change.offset == offset &&
+            change.length == length && change.old_phys_offset == old_phys_offset &&
+            change.new_phys_offset == new_phys_offset;
+}
+
+}
+
+int main() {
+    std::string old_map = write_map({
+        {"1", 4096, 0, 10, 1},
+        {"2", 8192, 0, 20, 2},
+        {"3", 40960, 0, 100, 10},
+        {"4", 40960, 0, 200, 10},
+        {"4", 40960, 12, 300, 2},
+        {"6", 32768, 0, 10, 4},
+        {"6", 32768, 4, 14, 4},
+    });
+    std::string new_map = write_map({
+        {"1", 4096, 0, 10, 1},
+        {"3", 49152, 0, 100, 4},
+        {"3", 49152, 4, 500, 6},
+        // the same blocks in other pieces, then a new range
+        {"4", 40960, 0, 200, 5},
+        {"4", 40960, 5, 205, 3},
+        {"4", 40960, 20, 900, 5},
+        {"5", 4096, 0, 30, 1},
+        {"6", 32768, 0, 50, 8},
+    });
+
+    std::vector<ExtentChange> changes;
+    SnapshotDiff diff;
+    diff.Diff(old_map, new_map, [&changes](const ExtentChange& change) {
+        changes.push_back(change);
+    });
+    unlink(old_map.c_str());
+    unlink(new_map.c_str());
+
+    CHECK(changes.size() == 8);
+    if (changes.size() == 8) {
+        CHECK(same(changes[0], ExtentChange::FILE_REMOVED, "2", 0, 0, 0, 0));
+        CHECK(changes[0].old_size == 8192 && changes[0].new_size == 0);
+        CHECK(same(changes[1], ExtentChange::FILE_RESIZED, "3", 0, 0, 0, 0));
+        CHECK(changes[1].old_size == 40960 && changes[1].new_size == 49152);
+        CHECK(same(changes[2], ExtentChange::RANGE_RELOCATED, "3", 4, 6, 104, 500));
+        CHECK(same(changes[3], ExtentChange::RANGE_REMOVED, "4", 8, 2, 208, 0));
+        CHECK(same(changes[4], ExtentChange::RANGE_REMOVED, "4", 12, 2, 300, 0));
+        CHECK(same(changes[5], ExtentChange::RANGE_ADDED, "4", 20, 5, 0, 900));
+        CHECK(same(changes[6], ExtentChange::FILE_ADDED, "5", 0, 0, 0, 0));
+        CHECK(changes[6].old_size == 0 && changes[6].new_size == 4096);
+        // two relocated pieces in a row are one change
+        CHECK(same(changes[7], ExtentChange::RANGE_RELOCATED, "6", 0, 8, 10, 50));
+    }
+
+    return test_result("test_diff");
+}
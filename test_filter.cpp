@@ -0,0 +1,35 @@
+#include "fs_stat.h"
+#include "test_util.h"
+
+int main() {
+    ScanFilter all;
+    CHECK(all.accepts_file(0) && all.accepts_file(UINT64_MAX));
+    CHECK(all.accepts_size(0));
+    CHECK(all.accepts_attr(0x80) && all.accepts_attr(0x30));
+    CHECK(all.accepts_range(0, 1) && all.accepts_range(1ULL << 40, 8));
+
+    ScanFilter filter;
+    filter.first_file = 16;
+    filter.last_file = 31;
+    filter.min_file_size = 4096;
+    filter.attr_types = {0x80};
+    filter.first_phys_block = 100;
+    filter.last_phys_block = 199;
+
+    // both file bounds are taken
+    CHECK(!filter.accepts_file(15));
+    CHECK(filter.accepts_file(16) && filter.accepts_file(31));
+    CHECK(!filter.accepts_file(32));
+
+    CHECK(!filter.accepts_size(4095) && filter.accepts_size(4096));
+    CHECK(filter.accepts_attr(0x80) && !filter.accepts_attr(0xa0));
+
+    // a range is taken if any of its blocks is in [first_phys_block, last_phys_block]
+    CHECK(!filter.accepts_range(90, 10));
+    CHECK(filter.accepts_range(90, 11));
+    CHECK(filter.accepts_range(150, 1000));
+    CHECK(filter.accepts_range(199, 1));
+    CHECK(!filter.accepts_range(200, 1));
+
+    return test_result("test_filter");
+}
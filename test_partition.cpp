@@ -0,0 +1,130 @@
+#include "FS.h"
+#include "test_util.h"
+
+namespace {
+
+const uint64_t SECTOR = 512;
+
+// an image in memory
+class MemoryDisk: public Disk {
+public:
+    MemoryDisk(size_t size) : data_(size) {}
+
+    void read_blocks(void* buffer, size_t size, uint64_t offset) {
+        if ((offset + size) * SECTOR > data_.size()) {
+            throw std::runtime_error("read past the end of the image");
+        }
+        memcpy(buffer, &data_[offset * SECTOR], size * SECTOR);
+    }
+    size_t get_block_size() {
+        return SECTOR;
+    }
+
+    template <class T>
+    T* at(uint64_t offset) {
+        return (T*) &data_[offset];
+    }
+
+private:
+    std::vector<char> data_;
+};
+
+void set_entry(MBRPartitionEntry& entry, uint8_t type, uint32_t first_lba, uint32_t sector_count) {
+    entry.type = type;
+    entry.first_lba = first_lba;
+    entry.sector_count = sector_count;
+}
+
+void mark_ext(MemoryDisk& disk, uint64_t offset) {
+    *disk.at<uint16_t>(offset + 1024 + 0x38) = 0xEF53;
+}
+
+bool has_partition(const std::vector<Partition>& partitions, uint32_t number, uint64_t offset, uint64_t size) {
+    for (const Partition& partition : partitions) {
+        if (partition.number == number) {
+            return partition.offset == offset && partition.size == size;
+        }
+    }
+    return false;
+}
+
+void test_unpartitioned() {
+    std::shared_ptr<MemoryDisk> disk(new MemoryDisk(1 << 20));
+    CHECK(FindPartitions(disk).empty());
+
+    // a filesystem is not a partition table, even if its boot sector has the signature
+    mark_ext(*disk, 0);
+    disk->at<MBR>(0)->signature = 0xaa55;
+    CHECK(FindPartitions(disk).empty());
+}
+
+void test_mbr() {
+    std::shared_ptr<MemoryDisk> disk(new MemoryDisk(8 << 20));
+    MBR* mbr = disk->at<MBR>(0);
+    mbr->signature = 0xaa55;
+    set_entry(mbr->partitions[0], 0x83, 2048, 2048);
+    set_entry(mbr->partitions[1], 0x05, 4096, 8192);
+    set_entry(mbr->partitions[3], 0x07, 12288, 2048);
+    mark_ext(*disk, 2048 * SECTOR);
+
+    // two logical partitions, each EBR relative to itself for the partition and to the
+    // extended partition for the next EBR
+    MBR* ebr = disk->at<MBR>(4096 * SECTOR);
+    ebr->signature = 0xaa55;
+    set_entry(ebr->partitions[0], 0x83, 63, 1000);
+    set_entry(ebr->partitions[1], 0x05, 2048, 4096);
+    ebr = disk->at<MBR>((4096 + 2048) * SECTOR);
+    ebr->signature = 0xaa55;
+    set_entry(ebr->partitions[0], 0x83, 63, 2000);
+    mark_ext(*disk, (4096 + 2048 + 63) * SECTOR);
+
+    std::vector<Partition> partitions = FindPartitions(disk);
+    CHECK(partitions.size() == 4);
+    CHECK(has_partition(partitions, 1, 2048 * SECTOR, 2048 * SECTOR));
+    CHECK(has_partition(partitions, 4, 12288 * SECTOR, 2048 * SECTOR));
+    CHECK(has_partition(partitions, 5, (4096 + 63) * SECTOR, 1000 * SECTOR));
+    CHECK(has_partition(partitions, 6, (4096 + 2048 + 63) * SECTOR, 2000 * SECTOR));
+    for (const Partition& partition : partitions) {
+        FSType expected = partition.number == 1 || partition.number == 6 ? FS_EXT : FS_UNKNOWN;
+        CHECK(partition.filesystem == expected);
+    }
+}
+
+void test_gpt(uint64_t sector_size) {
+    std::shared_ptr<MemoryDisk> disk(new MemoryDisk(8 << 20));
+    MBR* mbr = disk->at<MBR>(0);
+    mbr->signature = 0xaa55;
+    set_entry(mbr->partitions[0], 0xee, 1, UINT32_MAX);
+
+    GPTHeader* header = disk->at<GPTHeader>(sector_size);
+    memcpy(header->signature, "EFI PART", 8);
+    header->entries_lba = 2;
+    header->entry_count = 128;
+    header->entry_size = sizeof(GPTEntry);
+
+    // the first and third entries are used, the second is empty
+    GPTEntry* entries = disk->at<GPTEntry>(2 * sector_size);
+    entries[0].type_guid[0] = 1;
+    entries[0].first_lba = 64;
+    entries[0].last_lba = 127;
+    entries[2].type_guid[0] = 1;
+    entries[2].first_lba = 256;
+    entries[2].last_lba = 511;
+    mark_ext(*disk, 256 * sector_size);
+
+    std::vector<Partition> partitions = FindPartitions(disk);
+    CHECK(partitions.size() == 2);
+    CHECK(has_partition(partitions, 1, 64 * sector_size, 64 * sector_size));
+    CHECK(has_partition(partitions, 3, 256 * sector_size, 256 * sector_size));
+    CHECK(partitions.size() == 2 && partitions[0].filesystem == FS_UNKNOWN && partitions[1].filesystem == FS_EXT);
+}
+
+}
+
+int main() {
+    test_unpartitioned();
+    test_mbr();
+    test_gpt(512);
+    test_gpt(4096);
+    return test_result("test_partition");
+}
@@ -0,0 +1,83 @@
+#include "FS.h"
+#include "test_util.h"
+
+#include <map>
+
+namespace {
+
+void add(PathIndex& index, uint64_t file_num, uint64_t parent_num, const std::string& name) {
+    index.add(file_num, parent_num, name.data(), name.size());
+}
+
+std::map<uint64_t, std::string> resolve(PathIndex& index, const ScanFilter& filter = ScanFilter()) {
+    std::map<uint64_t, std::string> paths;
+    index.resolve(filter, [&paths](uint64_t file_num, const std::string& path) {
+        CHECK(paths.count(file_num) == 0);
+        paths[file_num] = path;
+    });
+    return paths;
+}
+
+void test_tree() {
+    // added out of order, as records and inodes come
+    PathIndex index;
+    add(index, 12, 11, "c.txt");
+    add(index, 11, 10, "b");
+    add(index, 2, 2, ".");
+    add(index, 10, 2, "a");
+    add(index, 13, 10, "d");
+    add(index, 12, 2, "link"); // hard link, the first name stays
+
+    std::map<uint64_t, std::string> paths = resolve(index);
+    CHECK(paths.size() == 5);
+    CHECK(paths[2] == "/");
+    CHECK(paths[10] == "/a");
+    CHECK(paths[11] == "/a/b");
+    CHECK(paths[12] == "/a/b/c.txt");
+    CHECK(paths[13] == "/a/d");
+
+    // resolve leaves the index empty for the next scan
+    CHECK(resolve(index).empty());
+}
+
+void test_broken_links() {
+    PathIndex index;
+    add(index, 2, 2, ".");
+    add(index, 20, 99, "orphan");
+    add(index, 21, 20, "child");
+    // a loop without the root, each file is still printed once
+    add(index, 30, 31, "x");
+    add(index, 31, 30, "y");
+
+    std::map<uint64_t, std::string> paths = resolve(index);
+    CHECK(paths.size() == 5);
+    CHECK(paths[20] == "<99>/orphan");
+    CHECK(paths[21] == "<99>/orphan/child");
+    CHECK(paths[30].compare(0, 1, "<") == 0 && paths[30].size() > 3);
+    CHECK(paths[31].compare(0, 1, "<") == 0 && paths[31].size() > 3);
+}
+
+void test_filter() {
+    PathIndex index;
+    add(index, 2, 2, ".");
+    add(index, 10, 2, "a");
+    add(index, 11, 10, "b");
+    add(index, 12, 11, "c");
+
+    // directories outside of the filter still name the files in it
+    ScanFilter filter;
+    filter.first_file = 12;
+    filter.last_file = 12;
+    std::map<uint64_t, std::string> paths = resolve(index, filter);
+    CHECK(paths.size() == 1);
+    CHECK(paths[12] == "/a/b/c");
+}
+
+}
+
+int main() {
+    test_tree();
+    test_broken_links();
+    test_filter();
+    return test_result("test_paths");
+}
@@ -0,0 +1,204 @@
+#include "fs_stat.h"
+#include "test_util.h"
+
+#include <map>
+#include <random>
+#include <tuple>
+
+namespace {
+
+struct Extent {
+    uint64_t offset;
+    uint64_t phys_offset;
+    uint64_t length;
+
+    bool operator<(const Extent& other) const {
+        return std::tie(offset, phys_offset, length) < std::tie(other.offset, other.phys_offset, other.length);
+    }
+    bool operator==(const Extent& other) const {
+        return offset == other.offset && phys_offset == other.phys_offset && length == other.length;
+    }
+};
+
+struct File {
+    uint64_t size;
+    std::vector<Extent> extents;
+};
+
+typedef std::map<std::string, File> Files;
+
+bool overlaps(uint64_t first, uint64_t first_len, uint64_t second, uint64_t second_len) {
+    return first <= second ? second - first < first_len : first - second < second_len;
+}
+
+// extents given to a BlockFunc, by file id
+struct Collector {
+    Collector() : sizes_match(true) {
+        func = [this](std::string file_id, uint64_t file_size, uint64_t offset, uint64_t phys_offset, uint64_t len) {
+            File& file = files[file_id];
+            if (!file.extents.empty() && file.size != file_size) {
+                sizes_match = false;
+            }
+            file.size = file_size;
+            file.extents.push_back({offset, phys_offset, len});
+        };
+    }
+
+    Files sorted() {
+        for (auto& entry : files) {
+            std::sort(entry.second.extents.begin(), entry.second.extents.end());
+        }
+        return files;
+    }
+
+    Files files;
+    bool sizes_match;
+    BlockFunc func;
+};
+
+bool same(const Files& a, const Files& b) {
+    if (a.size() != b.size()) {
+        return false;
+    }
+    for (auto ai = a.begin(), bi = b.begin(); ai != a.end(); ++ai, ++bi) {
+        if (ai->first != bi->first || ai->second.size != bi->second.size || ai->second.extents != bi->second.extents) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// ids like the parsers give (inode and record numbers, partition prefixes, NTFS streams)
+// and ones that only keep their numeric prefix as text
+std::string make_id(std::mt19937_64& random, int i) {
+    switch (i % 7) {
+    case 0:
+        return "p" + std::to_string(i % 3 + 1) + "/" + std::to_string(i);
+    case 1:
+        return std::to_string(i) + ":$DATA:stream" + std::to_string(i % 5);
+    case 2:
+        return "0" + std::to_string(i);
+    case 3:
+        return "123456789012345678901" + std::to_string(i);
+    default:
+        return std::to_string(random() % 100000000);
+    }
+}
+
+// values of every varint length, physical offsets going back and forth
+Files make_files(std::mt19937_64& random, int count) {
+    Files files;
+    for (int i = 0; i < count; i++) {
+        File file;
+        file.size = i % 4 ? (random() % 1000 + 1) * 4096 : random() >> (random() % 64);
+        uint64_t offset = random() % 4;
+        int extents = random() % 6;
+        for (int e = 0; e < extents; e++) {
+            uint64_t length = 1 + (random() >> (40 + random() % 24));
+            uint64_t phys_offset = random() >> (random() % 64);
+            if (phys_offset > UINT64_MAX - length) {
+                phys_offset -= length;
+            }
+            file.extents.push_back({offset, phys_offset, length});
+            offset += length + random() % 3;
+        }
+        files[make_id(random, i)] = file;
+    }
+    files["0"] = {0, {{0, 0, 1}}};
+    files["18446744073709551615"] = {UINT64_MAX, {{UINT64_MAX - 1, UINT64_MAX - 1, 1}}};
+    return files;
+}
+
+void test_round_trip(int count) {
+    std::mt19937_64 random(count);
+    Files files = make_files(random, count);
+
+    // each file in up to three pieces, all of them shuffled
+    struct Piece {
+        std::string file_id;
+        size_t first;
+        size_t end;
+    };
+    std::vector<Piece> pieces;
+    uint64_t extent_count = 0;
+    for (const auto& entry : files) {
+        size_t extents = entry.second.extents.size();
+        size_t split = extents ? random() % (extents + 1) : 0;
+        pieces.push_back({entry.first, 0, split});
+        pieces.push_back({entry.first, split, extents});
+        extent_count += extents;
+    }
+    std::shuffle(pieces.begin(), pieces.end(), random);
+
+    ExtentStore store;
+    for (const Piece& piece : pieces) {
+        const File& file = files[piece.file_id];
+        for (size_t e = piece.first; e < piece.end; e++) {
+            const Extent& extent = file.extents[e];
+            store.add(piece.file_id, file.size, extent.offset, extent.phys_offset, extent.length);
+        }
+    }
+    store.finish();
+
+    // files without extents aren't kept
+    Files expected;
+    for (const auto& entry : files) {
+        if (!entry.second.extents.empty()) {
+            expected[entry.first] = entry.second;
+        }
+    }
+    CHECK(store.file_count() == expected.size());
+    CHECK(store.extent_count() == extent_count);
+
+    Collector all;
+    store.ForEach(all.func);
+    CHECK(all.sizes_match);
+    CHECK(same(all.sorted(), expected));
+
+    for (const auto& entry : expected) {
+        Collector one;
+        CHECK(store.Find(entry.first, one.func));
+        CHECK(same(one.sorted(), Files{{entry.first, entry.second}}));
+
+        // a piece of the file
+        const Extent& middle = entry.second.extents[entry.second.extents.size() / 2];
+        Collector part;
+        store.Find(entry.first, part.func, middle.offset + middle.length - 1, 2);
+        File wanted = {entry.second.size, {}};
+        for (const Extent& extent : entry.second.extents) {
+            if (overlaps(extent.offset, extent.length, middle.offset + middle.length - 1, 2)) {
+                wanted.extents.push_back(extent);
+            }
+        }
+        CHECK(same(part.sorted(), Files{{entry.first, wanted}}));
+    }
+    Collector none;
+    CHECK(!store.Find("no such file", none.func));
+    CHECK(!store.Find("999999999999", none.func));
+
+    for (int query = 0; query < 50; query++) {
+        uint64_t phys_offset = random() >> (random() % 64);
+        uint64_t length = 1 + (random() >> (random() % 64));
+        Files wanted;
+        for (const auto& entry : expected) {
+            for (const Extent& extent : entry.second.extents) {
+                if (overlaps(extent.phys_offset, extent.length, phys_offset, length)) {
+                    wanted[entry.first].size = entry.second.size;
+                    wanted[entry.first].extents.push_back(extent);
+                }
+            }
+        }
+        Collector range;
+        store.FindRange(phys_offset, length, range.func);
+        CHECK(same(range.sorted(), wanted));
+    }
+}
+
+}
+
+int main() {
+    test_round_trip(1);
+    test_round_trip(64);
+    test_round_trip(1000);
+    return test_result("test_store");
+}
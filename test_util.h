@@ -0,0 +1,21 @@
+#ifndef TEST_UTIL_H
+#define	TEST_UTIL_H
+
+#include <cstdio>
+
+// each test program checks on and exits with the number of failed checks
+static int test_failures = 0;
+
+#define CHECK(condition) do { \
+        if (!(condition)) { \
+            fprintf(stderr, "%s:%d: failed %s\n", __FILE__, __LINE__, #condition); \
+            test_failures++; \
+        } \
+    } while (0)
+
+inline int test_result(const char* name) {
+    printf("%s: %s\n", name, test_failures ? "FAILED" : "ok");
+    return test_failures;
+}
+
+#endif	/* TEST_UTIL_H */
@@ -0,0 +1,155 @@
+#include "FS.h"
+
+#include <thread>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+namespace {
+
+// bucket depth, how far ahead of the rate a burst may go
+const double BURST_SECONDS = 0.1;
+// the adapted rate changes at most this often
+const std::chrono::milliseconds ADJUST_INTERVAL(50);
+// never adapted below, so a scan always moves on
+const double MIN_RATE = 256 * 1024;
+const size_t THROTTLE_PIECE = 256 * 1024;
+
+const int IOPRIO_WHO_PROCESS = 1;
+const int IOPRIO_CLASS_IDLE = 3;
+const int IOPRIO_CLASS_SHIFT = 13;
+
+uint64_t NanosecondsSince(std::chrono::steady_clock::time_point start) {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count();
+}
+
+// takes size from a bucket refilled at rate, returns the seconds to wait for the debt
+double take(double& tokens, double rate, double elapsed, double size) {
+    if (rate <= 0) {
+        tokens = 0;
+        return 0;
+    }
+    double burst = std::max(rate * BURST_SECONDS, size);
+    tokens = std::min(burst, tokens + rate * elapsed) - size;
+    return tokens < 0 ? -tokens / rate : 0;
+}
+
+}
+
+Throttle::Throttle(const ThrottleOptions& options) : byte_tokens_(0), read_tokens_(0),
+        refilled_(std::chrono::steady_clock::now()), adjusted_(refilled_) {
+    memset(&report_, 0, sizeof(report_));
+    set_options(options);
+}
+
+void Throttle::set_options(const ThrottleOptions& options) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    options_ = options;
+    rate_ = options.bytes_per_second;
+}
+
+ThrottleOptions Throttle::options() const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return options_;
+}
+
+ThrottleReport Throttle::report() const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    ThrottleReport report = report_;
+    report.byte_rate = byte_rate();
+    return report;
+}
+
+double Throttle::byte_rate() const {
+    return options_.latency_target_us ? rate_ : options_.bytes_per_second;
+}
+
+void Throttle::acquire(size_t size) {
+    double wait;
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        auto now = std::chrono::steady_clock::now();
+        double elapsed = std::chrono::duration<double>(now - refilled_).count();
+        refilled_ = now;
+        // the debt is taken now, so concurrent readers queue up behind each other
+        wait = std::max(take(byte_tokens_, byte_rate(), elapsed, size),
+                take(read_tokens_, options_.reads_per_second, elapsed, 1));
+        report_.wait_ns += wait * 1e9;
+    }
+    if (wait > 0) {
+        std::this_thread::sleep_for(std::chrono::duration<double>(wait));
+    }
+}
+
+void Throttle::complete(size_t size, uint64_t ns) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    report_.bytes += size;
+    report_.reads++;
+    report_.read_ns += ns;
+    if (!options_.latency_target_us) {
+        return;
+    }
+
+    auto now = std::chrono::steady_clock::now();
+    bool slow = ns > options_.latency_target_us * 1000;
+    report_.slow_reads += slow;
+    if (now - adjusted_ < ADJUST_INTERVAL) {
+        return;
+    }
+    if (slow) {
+        // from no limit, half of what this read got
+        rate_ = std::max(MIN_RATE, (rate_ > 0 ? rate_ : size * 1e9 / ns) / 2);
+        adjusted_ = now;
+    } else if (rate_ > 0) {
+        rate_ *= 1.1;
+        if (options_.bytes_per_second && rate_ > options_.bytes_per_second) {
+            rate_ = options_.bytes_per_second;
+        }
+        adjusted_ = now;
+    }
+}
+
+
+ThrottledDisk::ThrottledDisk(std::shared_ptr<Disk> disk, std::shared_ptr<Throttle> throttle) :
+        disk_(disk), throttle_(throttle) {}
+
+size_t ThrottledDisk::get_block_size() {
+    return disk_->get_block_size();
+}
+
+IdlePriorityScope::IdlePriorityScope(bool idle) : previous_(-1) {
+    int idle_class = IOPRIO_CLASS_IDLE << IOPRIO_CLASS_SHIFT;
+    if (idle) {
+        previous_ = syscall(SYS_ioprio_get, IOPRIO_WHO_PROCESS, 0);
+        if (previous_ == idle_class || syscall(SYS_ioprio_set, IOPRIO_WHO_PROCESS, 0, idle_class) != 0) {
+            previous_ = -1;
+        }
+    }
+}
+
+IdlePriorityScope::~IdlePriorityScope() {
+    if (previous_ >= 0) {
+        syscall(SYS_ioprio_set, IOPRIO_WHO_PROCESS, 0, previous_);
+    }
+}
+
+bool ThrottledDisk::concurrent_reads() {
+    return disk_->concurrent_reads();
+}
+
+void ThrottledDisk::read_blocks(void* buffer, size_t size, uint64_t offset) {
+    read(buffer, size * get_block_size(), offset * get_block_size());
+}
+
+void ThrottledDisk::read(void* buffer, size_t size, uint64_t offset) {
+    char* out = (char*) buffer;
+    while (size > 0) {
+        size_t piece = std::min(size, THROTTLE_PIECE);
+        throttle_->acquire(piece);
+        auto start = std::chrono::steady_clock::now();
+        disk_->read(out, piece, offset);
+        throttle_->complete(piece, NanosecondsSince(start));
+        out += piece;
+        offset += piece;
+        size -= piece;
+    }
+}